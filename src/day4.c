@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -71,16 +72,79 @@ void stack_clear(struct stack* s)
     s->size = 0;
 }
 
+// Roll coordinates, row by row: the rolls of row row_y[i] are in columns cols[row_start[i] .. row_start[i + 1]), in
+// increasing order. Rows without rolls are left out.
+struct roll_list {
+    size_t num_rolls;
+    size_t num_rows;
+    size_t* cols;
+    size_t* row_y;
+    size_t* row_start;
+};
+
+void free_roll_list(struct roll_list* rl)
+{
+    if (rl) {
+        free(rl->cols);
+        free(rl->row_y);
+        free(rl->row_start);
+        free(rl);
+    }
+}
+
+// Takes over the items of the three stacks, whose row_start already ends with the total.
+static struct roll_list* new_roll_list(struct stack* cols, struct stack* row_y, struct stack* row_start)
+{
+    struct roll_list* rl = malloc(sizeof(struct roll_list));
+    *rl = (struct roll_list) {
+        .num_rolls = cols->size,
+        .num_rows = row_y->size,
+        .cols = cols->items,
+        .row_y = row_y->items,
+        .row_start = row_start->items,
+    };
+    free(cols);
+    free(row_y);
+    free(row_start);
+    return rl;
+}
+
+struct roll_list* copy_roll_list(const struct roll_list* const rl)
+{
+    struct roll_list* new_rl = malloc(sizeof(struct roll_list));
+    *new_rl = *rl;
+    new_rl->cols = malloc((rl->num_rolls + 1) * sizeof(size_t));
+    new_rl->row_y = malloc((rl->num_rows + 1) * sizeof(size_t));
+    new_rl->row_start = malloc((rl->num_rows + 1) * sizeof(size_t));
+    memcpy(new_rl->cols, rl->cols, rl->num_rolls * sizeof(size_t));
+    memcpy(new_rl->row_y, rl->row_y, rl->num_rows * sizeof(size_t));
+    memcpy(new_rl->row_start, rl->row_start, (rl->num_rows + 1) * sizeof(size_t));
+    return new_rl;
+}
+
+enum roll_backend {
+    ROLL_BACKEND_DENSE,
+    ROLL_BACKEND_SPARSE,
+};
+
+// Below this share of occupied cells the sparse backend touches far less memory than the padded field.
+#define SPARSE_MAX_DENSITY_PERCENT 1
+
+// The backend is picked once, when the grid is parsed. Dense grids keep one bool per cell in `rolls`; sparse grids
+// keep only the roll coordinates in `list`, and `rolls` is NULL.
 struct roll_grid {
     size_t width;
     size_t height;
+    size_t num_rolls;
     bool* rolls;
+    struct roll_list* list;
 };
 
 void free_roll_grid(struct roll_grid* jb)
 {
     if (jb) {
         free(jb->rolls);
+        free_roll_list(jb->list);
         free(jb);
     }
 }
@@ -90,52 +154,111 @@ struct roll_grid* new_roll_grid(size_t width, size_t height)
     struct roll_grid* rg = malloc(sizeof(struct roll_grid));
     rg->width = width;
     rg->height = height;
+    rg->num_rolls = 0;
     rg->rolls = malloc(width * height * sizeof(bool));
     memset(rg->rolls, 0, width * height * sizeof(bool));
+    rg->list = NULL;
     return rg;
 }
 
 struct roll_grid* copy_roll_grid(const struct roll_grid* const rg)
 {
     struct roll_grid* new_rg = malloc(sizeof(struct roll_grid));
-    new_rg->width = rg->width;
-    new_rg->height = rg->height;
-    new_rg->rolls = malloc(rg->width * rg->height * sizeof(bool));
-    memcpy(new_rg->rolls, rg->rolls, rg->width * rg->height * sizeof(bool));
+    *new_rg = *rg;
+    if (rg->rolls) {
+        new_rg->rolls = malloc(rg->width * rg->height * sizeof(bool));
+        memcpy(new_rg->rolls, rg->rolls, rg->width * rg->height * sizeof(bool));
+    }
+    if (rg->list) {
+        new_rg->list = copy_roll_list(rg->list);
+    }
     return new_rg;
 }
 
+enum roll_backend roll_grid_backend(const struct roll_grid* const rg)
+{
+    return rg->list ? ROLL_BACKEND_SPARSE : ROLL_BACKEND_DENSE;
+}
+
 bool get_roll(const struct roll_grid* const rg, size_t x, size_t y)
 {
     if (x >= rg->width || y >= rg->height) {
         fprintf(stderr, "Roll coordinates out of range: (%zu, %zu)\n", x, y);
         abort();
     }
-    return rg->rolls[y * rg->width + x];
+    if (rg->rolls) {
+        return rg->rolls[y * rg->width + x];
+    }
+    const struct roll_list* rl = rg->list;
+    for (size_t i = 0; i < rl->num_rows && rl->row_y[i] <= y; ++i) {
+        if (rl->row_y[i] != y) {
+            continue;
+        }
+        for (size_t k = rl->row_start[i]; k < rl->row_start[i + 1]; ++k) {
+            if (rl->cols[k] == x) {
+                return true;
+            }
+        }
+    }
+    return false;
 }
 
 void print_roll_grid(const struct roll_grid* const rg)
 {
     for (size_t y = 0; y < rg->height; ++y) {
-        bool* row = &rg->rolls[y * rg->width];
         for (size_t x = 0; x < rg->width; ++x) {
-            printf("%c", row[x] ? '@' : '.');
+            printf("%c", get_roll(rg, x, y) ? '@' : '.');
         }
         printf("\n");
     }
 }
 
+// The roll coordinates of a dense grid, for a grid that turned out sparse or for running the sparse backend anyway.
+struct roll_list* roll_list_from_cells(const struct roll_grid* const rg)
+{
+    struct stack* cols = new_stack(128);
+    struct stack* row_y = new_stack(16);
+    struct stack* row_start = new_stack(16);
+    for (size_t y = 0; y < rg->height; ++y) {
+        const bool* row = &rg->rolls[y * rg->width];
+        size_t before = cols->size;
+        for (size_t x = 0; x < rg->width; ++x) {
+            if (row[x]) {
+                stack_push(cols, x);
+            }
+        }
+        if (cols->size != before) {
+            stack_push(row_y, y);
+            stack_push(row_start, before);
+        }
+    }
+    stack_push(row_start, cols->size);
+    return new_roll_list(cols, row_y, row_start);
+}
+
+// Rows are collected as roll coordinates for as long as the grid read so far is sparse enough for the sparse backend,
+// so a sparse grid never needs one bool per cell. Once the rolls seen outnumber that share of the cells seen, the
+// coordinates are expanded and the remaining rows are read straight into cells. A grid that only thins out after
+// that is turned back into coordinates at the end.
 struct roll_grid* parse_roll_grid(FILE* stream)
 {
     size_t width = 0;
     size_t height = 0;
     size_t line_length = 0;
+    struct stack* cols = new_stack(128);
+    struct stack* row_y = new_stack(16);
+    struct stack* row_start = new_stack(16);
+    size_t num_rolls = 0;
+    bool* cells = NULL;
+    size_t cell_rows_capacity = 0;
 
-    char buffer[256] = { 0 };
-    bool* rolls = NULL;
-    while (fgets(buffer, sizeof(buffer), stream)) {
+    // getline rather than a fixed buffer, so rows of any width are read whole
+    char* buffer = NULL;
+    size_t buffer_capacity = 0;
+    ssize_t read_length;
+    while ((read_length = getline(&buffer, &buffer_capacity, stream)) > 0) {
 
-        line_length = strnlen(buffer, 256);
+        line_length = (size_t)read_length;
         if (buffer[line_length - 1] == '\n') {
             --line_length;
             buffer[line_length] = '\0';
@@ -147,183 +270,1288 @@ struct roll_grid* parse_roll_grid(FILE* stream)
             width = line_length;
         }
 
-        if (height == 0) {
-            rolls = malloc((height + 1) * width * sizeof(bool));
-        } else {
-            rolls = realloc(rolls, (height + 1) * width * sizeof(bool));
-        }
-
-        bool* output_row = &rolls[width * height];
         for (size_t i = 0; i < line_length; ++i) {
-            if (buffer[i] == '@') {
-                output_row[i] = true;
-            } else if (buffer[i] == '.') {
-                output_row[i] = false;
-            } else {
+            if (buffer[i] != '@' && buffer[i] != '.') {
                 fprintf(stderr, "Invalid character in roll data: %c\n", buffer[i]);
                 abort();
             }
         }
-        memset(buffer, 0, sizeof(buffer));
 
+        if (cells) {
+            if (height == cell_rows_capacity) {
+                cell_rows_capacity *= 2;
+                cells = realloc(cells, cell_rows_capacity * width * sizeof(bool) + 1);
+            }
+            bool* row = &cells[height * width];
+            for (size_t i = 0; i < line_length; ++i) {
+                row[i] = buffer[i] == '@';
+                num_rolls += row[i];
+            }
+            ++height;
+            continue;
+        }
+
+        size_t before = cols->size;
+        for (size_t i = 0; i < line_length; ++i) {
+            if (buffer[i] == '@') {
+                stack_push(cols, i);
+            }
+        }
+        if (cols->size != before) {
+            stack_push(row_y, height);
+            stack_push(row_start, before);
+        }
+        num_rolls = cols->size;
         ++height;
+
+        if (num_rolls * 100 >= width * height * SPARSE_MAX_DENSITY_PERCENT) {
+            cell_rows_capacity = 2 * height;
+            cells = calloc(cell_rows_capacity * width + 1, sizeof(bool));
+            for (size_t i = 0; i < row_y->size; ++i) {
+                size_t row_end = i + 1 < row_y->size ? row_start->items[i + 1] : cols->size;
+                for (size_t k = row_start->items[i]; k < row_end; ++k) {
+                    cells[row_y->items[i] * width + cols->items[k]] = true;
+                }
+            }
+            stack_clear(cols);
+            stack_clear(row_y);
+            stack_clear(row_start);
+        }
     }
+    free(buffer);
 
-    struct roll_grid* rg = new_roll_grid(width, height);
-    memcpy(rg->rolls, rolls, width * height * sizeof(bool));
-    free(rolls);
+    struct roll_grid* rg = malloc(sizeof(struct roll_grid));
+    *rg = (struct roll_grid) { .width = width, .height = height, .num_rolls = num_rolls };
+    if (!cells) {
+        stack_push(row_start, cols->size);
+        rg->list = new_roll_list(cols, row_y, row_start);
+        return rg;
+    }
+    free_stack(cols);
+    free_stack(row_y);
+    free_stack(row_start);
 
+    rg->rolls = cells;
+    if (num_rolls * 100 < width * height * SPARSE_MAX_DENSITY_PERCENT) {
+        rg->list = roll_list_from_cells(rg);
+        rg->rolls = NULL;
+        free(cells);
+    }
     return rg;
 }
 
-static uint8_t bool_num(bool x) { return x ? 1 : 0; }
+// A stencil rule says which neighbours of a cell are counted and how few of them have to be rolls for the roll in
+// that cell to be accessible. The original puzzle is the Moore neighbourhood with a threshold of 4.
+enum neighborhood {
+    NEIGHBORHOOD_VON_NEUMANN,
+    NEIGHBORHOOD_MOORE,
+    NEIGHBORHOOD_MOORE_R2,
+};
+
+struct stencil_rule {
+    enum neighborhood neighborhood;
+    uint8_t threshold;
+};
+
+static const struct stencil_rule puzzle_rule = { .neighborhood = NEIGHBORHOOD_MOORE, .threshold = 4 };
+
+#define MAX_STENCIL_RADIUS 2
+
+size_t neighborhood_radius(enum neighborhood nh)
+{
+    switch (nh) {
+    case NEIGHBORHOOD_VON_NEUMANN:
+    case NEIGHBORHOOD_MOORE:
+        return 1;
+    case NEIGHBORHOOD_MOORE_R2:
+        return 2;
+    }
+    fprintf(stderr, "Unknown neighborhood: %d\n", (int)nh);
+    abort();
+}
+
+// Occupancy and neighbour counts with `radius` empty cells of padding on every side, so the kernels never need
+// bounds checks.
+struct stencil_field {
+    size_t width;
+    size_t height;
+    size_t radius;
+    size_t stride;
+    uint8_t* cells;
+    uint8_t* counts;
+};
+
+void free_stencil_field(struct stencil_field* f)
+{
+    if (f) {
+        free(f->cells);
+        free(f->counts);
+        free(f);
+    }
+}
+
+static size_t stencil_index(const struct stencil_field* const f, size_t x, size_t y)
+{
+    return (y + f->radius) * f->stride + x + f->radius;
+}
 
-uint8_t* count_adjacent(const struct roll_grid* const rg)
+static size_t stencil_unpad(const struct stencil_field* const f, size_t index)
 {
-    uint8_t* conv_res = malloc(rg->width * rg->height * sizeof(uint8_t));
-    memset(conv_res, 0, rg->width * rg->height * sizeof(uint8_t));
+    size_t y = index / f->stride - f->radius;
+    size_t x = index % f->stride - f->radius;
+    return y * f->width + x;
+}
 
-    size_t width = rg->width;
-    size_t height = rg->height;
+struct stencil_field* new_stencil_field(const struct roll_grid* const rg, size_t radius)
+{
+    struct stencil_field* f = malloc(sizeof(struct stencil_field));
+    f->width = rg->width;
+    f->height = rg->height;
+    f->radius = radius;
+    f->stride = rg->width + 2 * radius;
+    size_t padded_size = f->stride * (rg->height + 2 * radius);
+    f->cells = calloc(padded_size, sizeof(uint8_t));
+    f->counts = calloc(padded_size, sizeof(uint8_t));
 
-    // y = 0
-    {
-        bool* row = &rg->rolls[0 * width];
-        bool* row_below = &rg->rolls[1 * width];
-        uint8_t* output_row = &conv_res[0 * width];
-        output_row[0] = bool_num(row[1]);
-        output_row[0] += bool_num(row_below[0]) + bool_num(row_below[1]);
-        for (size_t x = 1; x < width - 1; ++x) {
-            output_row[x] = bool_num(row[x - 1]) + bool_num(row[x + 1]);
-            output_row[x] += bool_num(row_below[x - 1]) + bool_num(row_below[x]) + bool_num(row_below[x + 1]);
+    if (!rg->rolls) {
+        const struct roll_list* rl = rg->list;
+        for (size_t i = 0; i < rl->num_rows; ++i) {
+            for (size_t k = rl->row_start[i]; k < rl->row_start[i + 1]; ++k) {
+                f->cells[stencil_index(f, rl->cols[k], rl->row_y[i])] = 1;
+            }
+        }
+        return f;
+    }
+    for (size_t y = 0; y < rg->height; ++y) {
+        const bool* row = &rg->rolls[y * rg->width];
+        uint8_t* cell_row = &f->cells[stencil_index(f, 0, y)];
+        for (size_t x = 0; x < rg->width; ++x) {
+            cell_row[x] = row[x] ? 1 : 0;
         }
-        output_row[width - 1] = bool_num(row[width - 2]);
-        output_row[width - 1] += bool_num(row_below[width - 2]) + bool_num(row_below[width - 1]);
     }
+    return f;
+}
+
+size_t stencil_field_bytes(const struct stencil_field* const f)
+{
+    return 2 * f->stride * (f->height + 2 * f->radius) * sizeof(uint8_t);
+}
+
+size_t stack_bytes(const struct stack* const s) { return s->capacity * sizeof(size_t); }
 
-    for (size_t y = 1; y < height - 1; ++y) {
-        bool* row = &rg->rolls[y * width];
-        bool* row_above = &rg->rolls[(y - 1) * width];
-        bool* row_below = &rg->rolls[(y + 1) * width];
-        uint8_t* output_row = &conv_res[y * width];
-        output_row[0] = bool_num(row[1]);
-        output_row[0] += bool_num(row_below[0]) + bool_num(row_below[1]);
-        output_row[0] += bool_num(row_above[0]) + bool_num(row_above[1]);
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Per-round record of a peel. Round 0 is the setup (neighbour counts and the initial scan); its frontier is the
+// number of rolls accessible before anything is removed. For later rounds `frontier` is how many rolls became
+// accessible for the next round, and `bytes_allocated` is how much the worklists grew.
+struct peel_round {
+    size_t round;
+    size_t removed;
+    size_t frontier;
+    uint64_t elapsed_ns;
+    size_t bytes_allocated;
+};
+
+struct peel_trace {
+    size_t capacity;
+    size_t num_rounds;
+    struct peel_round* rounds;
+};
+
+struct peel_trace* new_peel_trace(void)
+{
+    struct peel_trace* trace = malloc(sizeof(struct peel_trace));
+    trace->capacity = 64;
+    trace->num_rounds = 0;
+    trace->rounds = malloc(trace->capacity * sizeof(struct peel_round));
+    return trace;
+}
 
-        for (size_t x = 1; x < width - 1; ++x) {
-            output_row[x] = bool_num(row[x - 1]) + bool_num(row[x + 1]);
-            output_row[x] += bool_num(row_above[x - 1]) + bool_num(row_above[x]) + bool_num(row_above[x + 1]);
-            output_row[x] += bool_num(row_below[x - 1]) + bool_num(row_below[x]) + bool_num(row_below[x + 1]);
+void free_peel_trace(struct peel_trace* trace)
+{
+    if (trace) {
+        free(trace->rounds);
+        free(trace);
+    }
+}
+
+void peel_trace_record(
+    struct peel_trace* trace, size_t removed, size_t frontier, uint64_t elapsed_ns, size_t bytes_allocated)
+{
+    if (trace->num_rounds >= trace->capacity) {
+        trace->capacity *= 2;
+        trace->rounds = realloc(trace->rounds, trace->capacity * sizeof(struct peel_round));
+    }
+    trace->rounds[trace->num_rounds] = (struct peel_round) {
+        .round = trace->num_rounds,
+        .removed = removed,
+        .frontier = frontier,
+        .elapsed_ns = elapsed_ns,
+        .bytes_allocated = bytes_allocated,
+    };
+    ++trace->num_rounds;
+}
+
+void peel_trace_write_csv(const struct peel_trace* const trace, FILE* out)
+{
+    fprintf(out, "round,removed,frontier,elapsed_ns,bytes_allocated\n");
+    for (size_t i = 0; i < trace->num_rounds; ++i) {
+        const struct peel_round* r = &trace->rounds[i];
+        fprintf(out, "%zu,%zu,%zu,%lu,%zu\n", r->round, r->removed, r->frontier, r->elapsed_ns, r->bytes_allocated);
+    }
+}
+
+void peel_trace_write_json(const struct peel_trace* const trace, FILE* out)
+{
+    fprintf(out, "[");
+    for (size_t i = 0; i < trace->num_rounds; ++i) {
+        const struct peel_round* r = &trace->rounds[i];
+        fprintf(out,
+            "%s\n  {\"round\": %zu, \"removed\": %zu, \"frontier\": %zu, \"elapsed_ns\": %lu, \"bytes_allocated\": %zu}",
+            i == 0 ? "" : ",", r->round, r->removed, r->frontier, r->elapsed_ns, r->bytes_allocated);
+    }
+    fprintf(out, "\n]\n");
+}
+
+// Generates the kernels for one neighbourhood. IN_NEIGHBORHOOD is an expression in dx and dy that is constant once
+// the offset loops are unrolled, so each kernel ends up as a fixed list of shifted-row adds.
+//
+// name##_count_row fills in the neighbour counts of one row from the 2R+1 rows around it, one shifted row at a time
+// so the x loop vectorizes; name##_count runs it over the whole field.
+// name##_peel removes accessible rolls round by round until none are left and returns how many were removed. Only
+// the neighbours of removed rolls are revisited: a roll joins the next round the moment its count drops below the
+// threshold, which is the same set the full-grid rescan would find. If `layers` is non-null, the round in which each
+// roll is removed is written to it at the roll's unpadded index.
+#define DEFINE_STENCIL_KERNELS(name, R, IN_NEIGHBORHOOD)                                                               \
+    static inline bool name##_in(int64_t dx, int64_t dy)                                                               \
+    {                                                                                                                  \
+        return (dx != 0 || dy != 0) && (IN_NEIGHBORHOOD);                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static void name##_count_row(const uint8_t* const* rows, size_t width, uint8_t* out)                               \
+    {                                                                                                                  \
+        memset(out, 0, width);                                                                                         \
+        _Pragma("GCC unroll 8") for (int64_t dy = -(R); dy <= (R); ++dy)                                               \
+        {                                                                                                              \
+            _Pragma("GCC unroll 8") for (int64_t dx = -(R); dx <= (R); ++dx)                                           \
+            {                                                                                                          \
+                if (!name##_in(dx, dy)) {                                                                              \
+                    continue;                                                                                          \
+                }                                                                                                      \
+                const uint8_t* src = rows[dy + (R)] + dx;                                                              \
+                for (size_t x = 0; x < width; ++x) {                                                                   \
+                    out[x] = (uint8_t)(out[x] + src[x]);                                                               \
+                }                                                                                                      \
+            }                                                                                                          \
+        }                                                                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static void name##_count(struct stencil_field* f)                                                                  \
+    {                                                                                                                  \
+        const uint8_t* rows[2 * (R) + 1];                                                                              \
+        for (size_t y = 0; y < f->height; ++y) {                                                                       \
+            for (size_t k = 0; k < 2 * (size_t)(R) + 1; ++k) {                                                         \
+                rows[k] = &f->cells[stencil_index(f, 0, y + k) - (size_t)(R) * f->stride];                             \
+            }                                                                                                          \
+            name##_count_row(rows, f->width, &f->counts[stencil_index(f, 0, y)]);                                      \
+        }                                                                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline void name##_release(struct stencil_field* f, size_t index, uint8_t threshold, struct stack* next)    \
+    {                                                                                                                  \
+        const ptrdiff_t stride = (ptrdiff_t)f->stride;                                                                 \
+        _Pragma("GCC unroll 8") for (int64_t dy = -(R); dy <= (R); ++dy)                                               \
+        {                                                                                                              \
+            _Pragma("GCC unroll 8") for (int64_t dx = -(R); dx <= (R); ++dx)                                           \
+            {                                                                                                          \
+                if (!name##_in(dx, dy)) {                                                                              \
+                    continue;                                                                                          \
+                }                                                                                                      \
+                size_t n = (size_t)((ptrdiff_t)index + dy * stride + dx);                                              \
+                if (f->cells[n]) {                                                                                     \
+                    --f->counts[n];                                                                                    \
+                    if (f->counts[n] + 1 == threshold) {                                                               \
+                        stack_push(next, n);                                                                           \
+                    }                                                                                                  \
+                }                                                                                                      \
+            }                                                                                                          \
+        }                                                                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static size_t name##_peel(struct stencil_field* f, uint8_t threshold, struct peel_trace* trace, uint32_t* layers)  \
+    {                                                                                                                  \
+        uint64_t round_start = trace ? now_ns() : 0;                                                                   \
+        name##_count(f);                                                                                               \
+        struct stack* frontier = new_stack(128);                                                                       \
+        struct stack* next = new_stack(128);                                                                           \
+        for (size_t y = 0; y < f->height; ++y) {                                                                       \
+            for (size_t x = 0; x < f->width; ++x) {                                                                    \
+                size_t i = stencil_index(f, x, y);                                                                     \
+                if (f->cells[i] && f->counts[i] < threshold) {                                                         \
+                    stack_push(frontier, i);                                                                           \
+                }                                                                                                      \
+            }                                                                                                          \
+        }                                                                                                              \
+        if (trace) {                                                                                                   \
+            size_t setup_bytes = stencil_field_bytes(f) + stack_bytes(frontier) + stack_bytes(next);                   \
+            peel_trace_record(trace, 0, frontier->size, now_ns() - round_start, setup_bytes);                          \
+        }                                                                                                              \
+                                                                                                                       \
+        size_t removed = 0;                                                                                            \
+        uint32_t layer = 0;                                                                                            \
+        while (!stack_is_empty(frontier)) {                                                                            \
+            ++layer;                                                                                                   \
+            size_t bytes_before = 0;                                                                                   \
+            if (trace) {                                                                                               \
+                round_start = now_ns();                                                                                \
+                bytes_before = stack_bytes(frontier) + stack_bytes(next);                                              \
+            }                                                                                                          \
+            for (size_t k = 0; k < frontier->size; ++k) {                                                              \
+                f->cells[frontier->items[k]] = 0;                                                                      \
+            }                                                                                                          \
+            if (layers) {                                                                                              \
+                for (size_t k = 0; k < frontier->size; ++k) {                                                          \
+                    layers[stencil_unpad(f, frontier->items[k])] = layer;                                              \
+                }                                                                                                      \
+            }                                                                                                          \
+            for (size_t k = 0; k < frontier->size; ++k) {                                                              \
+                name##_release(f, frontier->items[k], threshold, next);                                                \
+            }                                                                                                          \
+            removed += frontier->size;                                                                                 \
+            if (trace) {                                                                                               \
+                size_t bytes_after = stack_bytes(frontier) + stack_bytes(next);                                        \
+                peel_trace_record(                                                                                     \
+                    trace, frontier->size, next->size, now_ns() - round_start, bytes_after - bytes_before);            \
+            }                                                                                                          \
+                                                                                                                       \
+            struct stack* tmp = frontier;                                                                              \
+            frontier = next;                                                                                           \
+            next = tmp;                                                                                                \
+            stack_clear(next);                                                                                         \
+        }                                                                                                              \
+                                                                                                                       \
+        free_stack(frontier);                                                                                          \
+        free_stack(next);                                                                                              \
+        return removed;                                                                                                \
+    }
+
+DEFINE_STENCIL_KERNELS(von_neumann, 1, dx == 0 || dy == 0)
+DEFINE_STENCIL_KERNELS(moore, 1, true)
+DEFINE_STENCIL_KERNELS(moore_r2, 2, true)
+
+static void stencil_count(struct stencil_field* f, enum neighborhood nh)
+{
+    switch (nh) {
+    case NEIGHBORHOOD_VON_NEUMANN:
+        von_neumann_count(f);
+        return;
+    case NEIGHBORHOOD_MOORE:
+        moore_count(f);
+        return;
+    case NEIGHBORHOOD_MOORE_R2:
+        moore_r2_count(f);
+        return;
+    }
+}
+
+size_t dense_count_accessible(const struct roll_grid* const rg, struct stencil_rule rule)
+{
+    struct stencil_field* f = new_stencil_field(rg, neighborhood_radius(rule.neighborhood));
+    stencil_count(f, rule.neighborhood);
+
+    size_t count = 0;
+    for (size_t y = 0; y < f->height; ++y) {
+        const uint8_t* cell_row = &f->cells[stencil_index(f, 0, y)];
+        const uint8_t* count_row = &f->counts[stencil_index(f, 0, y)];
+        for (size_t x = 0; x < f->width; ++x) {
+            count += (cell_row[x] & (count_row[x] < rule.threshold));
         }
-        output_row[width - 1] = bool_num(row[width - 2]);
-        output_row[width - 1] += bool_num(row_below[width - 2]) + bool_num(row_below[width - 1]);
-        output_row[width - 1] += bool_num(row_above[width - 2]) + bool_num(row_above[width - 1]);
     }
 
-    // y = height-1
-    {
-        bool* row = &rg->rolls[(height - 1) * width];
-        bool* row_above = &rg->rolls[(height - 2) * width];
-        uint8_t* output_row = &conv_res[(height - 1) * width];
-        output_row[0] = bool_num(row[1]);
-        output_row[0] += bool_num(row_above[0]) + bool_num(row_above[1]);
-        for (size_t x = 1; x < width - 1; ++x) {
-            output_row[x] = bool_num(row[x - 1]) + bool_num(row[x + 1]);
-            output_row[x] += bool_num(row_above[x - 1]) + bool_num(row_above[x]) + bool_num(row_above[x + 1]);
+    free_stencil_field(f);
+    return count;
+}
+
+// Peels the rolls in `f` in place, leaving only the rolls that are never accessible.
+static size_t stencil_peel_field(
+    struct stencil_field* f, struct stencil_rule rule, struct peel_trace* trace, uint32_t* layers)
+{
+    switch (rule.neighborhood) {
+    case NEIGHBORHOOD_VON_NEUMANN:
+        return von_neumann_peel(f, rule.threshold, trace, layers);
+    case NEIGHBORHOOD_MOORE:
+        return moore_peel(f, rule.threshold, trace, layers);
+    case NEIGHBORHOOD_MOORE_R2:
+        return moore_r2_peel(f, rule.threshold, trace, layers);
+    }
+    return 0;
+}
+
+size_t dense_peel(
+    const struct roll_grid* const rg, struct stencil_rule rule, struct peel_trace* trace, uint32_t* layers)
+{
+    struct stencil_field* f = new_stencil_field(rg, neighborhood_radius(rule.neighborhood));
+    size_t removed = stencil_peel_field(f, rule, trace, layers);
+    free_stencil_field(f);
+    return removed;
+}
+
+static bool neighborhood_contains(enum neighborhood nh, int64_t dx, int64_t dy)
+{
+    switch (nh) {
+    case NEIGHBORHOOD_VON_NEUMANN:
+        return llabs(dx) <= 1 && llabs(dy) <= 1 && von_neumann_in(dx, dy);
+    case NEIGHBORHOOD_MOORE:
+        return llabs(dx) <= 1 && llabs(dy) <= 1 && moore_in(dx, dy);
+    case NEIGHBORHOOD_MOORE_R2:
+        return llabs(dx) <= 2 && llabs(dy) <= 2 && moore_r2_in(dx, dy);
+    }
+    return false;
+}
+
+// Rolls as row-major sorted coordinates, borrowed from the grid's roll_list (or built from the cells of a dense
+// grid, and then owned). Neighbours are found by merge-joining each row with the rows within the radius and kept as
+// an adjacency list, so both parts run in O(rolls).
+struct sparse_rolls {
+    size_t num_rolls;
+    size_t num_rows;
+    const size_t* cols;
+    const size_t* row_y;
+    const size_t* row_start;
+    size_t* adjacency_start;
+    struct stack* adjacency;
+    struct roll_list* owned_list;
+};
+
+void free_sparse_rolls(struct sparse_rolls* sr)
+{
+    if (sr) {
+        free_roll_list(sr->owned_list);
+        free(sr->adjacency_start);
+        free_stack(sr->adjacency);
+        free(sr);
+    }
+}
+
+size_t sparse_rolls_bytes(const struct sparse_rolls* const sr)
+{
+    return (2 * sr->num_rolls + 2 * sr->num_rows + 2) * sizeof(size_t) + stack_bytes(sr->adjacency);
+}
+
+static void sparse_rolls_link(struct sparse_rolls* sr, enum neighborhood nh)
+{
+    int64_t radius = (int64_t)neighborhood_radius(nh);
+    size_t adjacent_rows[2 * MAX_STENCIL_RADIUS + 1];
+    size_t cursors[2 * MAX_STENCIL_RADIUS + 1];
+
+    sr->adjacency_start = malloc((sr->num_rolls + 1) * sizeof(size_t));
+    sr->adjacency = new_stack(sr->num_rolls + 1);
+
+    size_t first_adjacent = 0;
+    for (size_t i = 0; i < sr->num_rows; ++i) {
+        int64_t y = (int64_t)sr->row_y[i];
+        while ((int64_t)sr->row_y[first_adjacent] < y - radius) {
+            ++first_adjacent;
+        }
+        size_t num_adjacent = 0;
+        for (size_t j = first_adjacent; j < sr->num_rows && (int64_t)sr->row_y[j] <= y + radius; ++j) {
+            adjacent_rows[num_adjacent] = j;
+            cursors[num_adjacent] = sr->row_start[j];
+            ++num_adjacent;
+        }
+
+        for (size_t k = sr->row_start[i]; k < sr->row_start[i + 1]; ++k) {
+            int64_t x = (int64_t)sr->cols[k];
+            sr->adjacency_start[k] = sr->adjacency->size;
+            for (size_t a = 0; a < num_adjacent; ++a) {
+                size_t j = adjacent_rows[a];
+                int64_t dy = (int64_t)sr->row_y[j] - y;
+                size_t row_end = sr->row_start[j + 1];
+                while (cursors[a] < row_end && (int64_t)sr->cols[cursors[a]] < x - radius) {
+                    ++cursors[a];
+                }
+                for (size_t c = cursors[a]; c < row_end && (int64_t)sr->cols[c] <= x + radius; ++c) {
+                    if (neighborhood_contains(nh, (int64_t)sr->cols[c] - x, dy)) {
+                        stack_push(sr->adjacency, c);
+                    }
+                }
+            }
         }
-        output_row[width - 1] = bool_num(row[width - 2]);
-        output_row[width - 1] += bool_num(row_above[width - 2]) + bool_num(row_above[width - 1]);
     }
+    sr->adjacency_start[sr->num_rolls] = sr->adjacency->size;
+}
+
+struct sparse_rolls* new_sparse_rolls(const struct roll_grid* const rg, enum neighborhood nh)
+{
+    struct sparse_rolls* sr = malloc(sizeof(struct sparse_rolls));
+    struct roll_list* owned_list = rg->list ? NULL : roll_list_from_cells(rg);
+    const struct roll_list* rl = rg->list ? rg->list : owned_list;
+    *sr = (struct sparse_rolls) {
+        .num_rolls = rl->num_rolls,
+        .num_rows = rl->num_rows,
+        .cols = rl->cols,
+        .row_y = rl->row_y,
+        .row_start = rl->row_start,
+        .owned_list = owned_list,
+    };
+    sparse_rolls_link(sr, nh);
+    return sr;
+}
+
+static uint8_t sparse_degree(const struct sparse_rolls* const sr, size_t k)
+{
+    return (uint8_t)(sr->adjacency_start[k + 1] - sr->adjacency_start[k]);
+}
 
-    return conv_res;
+size_t sparse_count_accessible(const struct roll_grid* const rg, struct stencil_rule rule)
+{
+    struct sparse_rolls* sr = new_sparse_rolls(rg, rule.neighborhood);
+    size_t count = 0;
+    for (size_t k = 0; k < sr->num_rolls; ++k) {
+        count += sparse_degree(sr, k) < rule.threshold;
+    }
+    free_sparse_rolls(sr);
+    return count;
 }
 
-struct stack* get_removables(const struct roll_grid* const rg, struct stack* removeables)
+// Same round structure as the dense peel, over the adjacency list instead of the padded field.
+size_t sparse_peel(
+    const struct roll_grid* const rg, struct stencil_rule rule, struct peel_trace* trace, uint32_t* layers)
 {
-    stack_clear(removeables);
+    uint64_t round_start = trace ? now_ns() : 0;
+    struct sparse_rolls* sr = new_sparse_rolls(rg, rule.neighborhood);
+    uint8_t* counts = malloc(sr->num_rolls * sizeof(uint8_t));
+    bool* present = malloc(sr->num_rolls * sizeof(bool));
+    struct stack* frontier = new_stack(128);
+    struct stack* next = new_stack(128);
+    for (size_t k = 0; k < sr->num_rolls; ++k) {
+        counts[k] = sparse_degree(sr, k);
+        present[k] = true;
+        if (counts[k] < rule.threshold) {
+            stack_push(frontier, k);
+        }
+    }
+    if (trace) {
+        size_t setup_bytes = sparse_rolls_bytes(sr) + sr->num_rolls * (sizeof(uint8_t) + sizeof(bool))
+            + stack_bytes(frontier) + stack_bytes(next);
+        peel_trace_record(trace, 0, frontier->size, now_ns() - round_start, setup_bytes);
+    }
+
+    size_t removed = 0;
+    uint32_t layer = 0;
+    uint32_t* roll_layers = layers ? calloc(sr->num_rolls, sizeof(uint32_t)) : NULL;
+    while (!stack_is_empty(frontier)) {
+        ++layer;
+        size_t bytes_before = 0;
+        if (trace) {
+            round_start = now_ns();
+            bytes_before = stack_bytes(frontier) + stack_bytes(next);
+        }
+        for (size_t i = 0; i < frontier->size; ++i) {
+            present[frontier->items[i]] = false;
+        }
+        if (roll_layers) {
+            for (size_t i = 0; i < frontier->size; ++i) {
+                roll_layers[frontier->items[i]] = layer;
+            }
+        }
+        for (size_t i = 0; i < frontier->size; ++i) {
+            size_t k = frontier->items[i];
+            for (size_t a = sr->adjacency_start[k]; a < sr->adjacency_start[k + 1]; ++a) {
+                size_t n = sr->adjacency->items[a];
+                if (present[n]) {
+                    --counts[n];
+                    if (counts[n] + 1 == rule.threshold) {
+                        stack_push(next, n);
+                    }
+                }
+            }
+        }
+        removed += frontier->size;
+        if (trace) {
+            size_t bytes_after = stack_bytes(frontier) + stack_bytes(next);
+            peel_trace_record(trace, frontier->size, next->size, now_ns() - round_start, bytes_after - bytes_before);
+        }
 
-    uint8_t* conv_res = count_adjacent(rg);
-    size_t width = rg->width;
-    size_t height = rg->height;
+        struct stack* tmp = frontier;
+        frontier = next;
+        next = tmp;
+        stack_clear(next);
+    }
 
-    for (size_t y = 0; y < height; ++y) {
-        uint8_t* conv_row = &conv_res[y * width];
-        bool* roll_row = &rg->rolls[y * width];
-        for (size_t x = 0; x < width; ++x) {
-            if (roll_row[x] && conv_row[x] < 4) {
-                stack_push(removeables, y * width + x);
+    free_stack(frontier);
+    free_stack(next);
+    if (roll_layers) {
+        for (size_t i = 0; i < sr->num_rows; ++i) {
+            uint32_t* layer_row = &layers[sr->row_y[i] * rg->width];
+            for (size_t k = sr->row_start[i]; k < sr->row_start[i + 1]; ++k) {
+                if (roll_layers[k] != 0) {
+                    layer_row[sr->cols[k]] = roll_layers[k];
+                }
             }
         }
+        free(roll_layers);
     }
 
-    free(conv_res);
-    return removeables;
+    free(counts);
+    free(present);
+    free_sparse_rolls(sr);
+    return removed;
 }
 
-size_t part2_greedy(const struct roll_grid* const rg)
+size_t stencil_count_accessible(const struct roll_grid* const rg, struct stencil_rule rule)
 {
-    struct stack* removeables = new_stack(128);
-    removeables = get_removables(rg, removeables);
-    if (stack_is_empty(removeables)) {
-        free_stack(removeables);
-        return 0;
+    if (roll_grid_backend(rg) == ROLL_BACKEND_SPARSE) {
+        return sparse_count_accessible(rg, rule);
+    }
+    return dense_count_accessible(rg, rule);
+}
+
+// Peels with `rule` and, if `trace` is non-null, appends one record per round to it.
+size_t stencil_peel_traced(const struct roll_grid* const rg, struct stencil_rule rule, struct peel_trace* trace)
+{
+    if (roll_grid_backend(rg) == ROLL_BACKEND_SPARSE) {
+        return sparse_peel(rg, rule, trace, NULL);
+    }
+    return dense_peel(rg, rule, trace, NULL);
+}
+
+// The round in which every roll is peeled, from a single peel. Cells without a roll are 0 and rolls that are never
+// removed are PEEL_LAYER_SURVIVOR. removed_by_round[r] is how many rolls are gone after r rounds.
+#define PEEL_LAYER_SURVIVOR UINT32_MAX
+
+struct peel_layers {
+    size_t width;
+    size_t height;
+    size_t num_rounds;
+    uint32_t* layers;
+    size_t* removed_by_round;
+};
+
+void free_peel_layers(struct peel_layers* pl)
+{
+    if (pl) {
+        free(pl->layers);
+        free(pl->removed_by_round);
+        free(pl);
+    }
+}
+
+struct peel_layers* new_peel_layers(const struct roll_grid* const rg, struct stencil_rule rule)
+{
+    size_t cells = rg->width * rg->height;
+    struct peel_layers* pl = malloc(sizeof(struct peel_layers));
+    pl->width = rg->width;
+    pl->height = rg->height;
+    pl->layers = calloc(cells + 1, sizeof(uint32_t));
+    if (rg->rolls) {
+        for (size_t i = 0; i < cells; ++i) {
+            pl->layers[i] = rg->rolls[i] ? PEEL_LAYER_SURVIVOR : 0;
+        }
+    } else {
+        const struct roll_list* rl = rg->list;
+        for (size_t i = 0; i < rl->num_rows; ++i) {
+            for (size_t k = rl->row_start[i]; k < rl->row_start[i + 1]; ++k) {
+                pl->layers[rl->row_y[i] * rg->width + rl->cols[k]] = PEEL_LAYER_SURVIVOR;
+            }
+        }
     }
 
-    struct roll_grid* rg_copy = copy_roll_grid(rg);
+    if (roll_grid_backend(rg) == ROLL_BACKEND_SPARSE) {
+        sparse_peel(rg, rule, NULL, pl->layers);
+    } else {
+        dense_peel(rg, rule, NULL, pl->layers);
+    }
+
+    pl->num_rounds = 0;
+    for (size_t i = 0; i < cells; ++i) {
+        if (pl->layers[i] != PEEL_LAYER_SURVIVOR && pl->layers[i] > pl->num_rounds) {
+            pl->num_rounds = pl->layers[i];
+        }
+    }
+    pl->removed_by_round = calloc(pl->num_rounds + 1, sizeof(size_t));
+    for (size_t i = 0; i < cells; ++i) {
+        if (pl->layers[i] != 0 && pl->layers[i] != PEEL_LAYER_SURVIVOR) {
+            ++pl->removed_by_round[pl->layers[i]];
+        }
+    }
+    for (size_t r = 1; r <= pl->num_rounds; ++r) {
+        pl->removed_by_round[r] += pl->removed_by_round[r - 1];
+    }
+    return pl;
+}
+
+uint32_t peel_layers_round(const struct peel_layers* const pl, size_t x, size_t y)
+{
+    if (x >= pl->width || y >= pl->height) {
+        fprintf(stderr, "Roll coordinates out of range: (%zu, %zu)\n", x, y);
+        abort();
+    }
+    return pl->layers[y * pl->width + x];
+}
+
+size_t peel_layers_removed_after(const struct peel_layers* const pl, size_t rounds)
+{
+    return pl->removed_by_round[rounds < pl->num_rounds ? rounds : pl->num_rounds];
+}
+
+size_t stencil_peel(const struct roll_grid* const rg, struct stencil_rule rule)
+{
+    return stencil_peel_traced(rg, rule, NULL);
+}
+
+// Keeps both answers current while single rolls are added and removed.
+//
+// `live` holds the rolls and, for every cell, how many neighbours are rolls, which is all part 1 needs. Part 2 is
+// tracked through the rolls that survive peeling: `core` holds them and, for every cell, how many neighbours are in
+// the core. The core is the largest set of rolls in which every roll has at least `threshold` neighbours, so part 2 is
+// the number of rolls outside it.
+//
+// Removing a core roll can only shrink the core, by a cascade from its neighbours. Adding a roll can only grow it, and
+// only by rolls connected to the new one through rolls outside the core, so that region alone is re-peeled against
+// the unchanged core.
+struct roll_tracker {
+    struct stencil_rule rule;
+    struct stencil_field* live;
+    struct stencil_field* core;
+    size_t num_rolls;
+    size_t num_core;
+    size_t accessible;
+    size_t num_offsets;
+    ptrdiff_t offsets[(2 * MAX_STENCIL_RADIUS + 1) * (2 * MAX_STENCIL_RADIUS + 1)];
+    uint8_t* region_mark;
+    uint8_t* region_counts;
+    struct stack* region;
+    struct stack* worklist;
+};
+
+enum region_mark {
+    REGION_OUTSIDE = 0,
+    REGION_CANDIDATE = 1,
+    REGION_PEELED = 2,
+};
+
+void free_roll_tracker(struct roll_tracker* rt)
+{
+    if (rt) {
+        free_stencil_field(rt->live);
+        free_stencil_field(rt->core);
+        free(rt->region_mark);
+        free(rt->region_counts);
+        free_stack(rt->region);
+        free_stack(rt->worklist);
+        free(rt);
+    }
+}
+
+struct roll_tracker* new_roll_tracker(const struct roll_grid* const rg, struct stencil_rule rule)
+{
+    size_t radius = neighborhood_radius(rule.neighborhood);
+    struct roll_tracker* rt = malloc(sizeof(struct roll_tracker));
+    rt->rule = rule;
+    rt->live = new_stencil_field(rg, radius);
+    rt->core = new_stencil_field(rg, radius);
+
+    stencil_count(rt->live, rule.neighborhood);
+    size_t peeled = stencil_peel_field(rt->core, rule, NULL, NULL);
+    stencil_count(rt->core, rule.neighborhood);
+
+    rt->num_rolls = 0;
+    rt->accessible = 0;
+    for (size_t y = 0; y < rg->height; ++y) {
+        for (size_t x = 0; x < rg->width; ++x) {
+            size_t i = stencil_index(rt->live, x, y);
+            rt->num_rolls += rt->live->cells[i];
+            rt->accessible += (rt->live->cells[i] & (rt->live->counts[i] < rule.threshold));
+        }
+    }
+    rt->num_core = rt->num_rolls - peeled;
+
+    rt->num_offsets = 0;
+    int64_t r = (int64_t)radius;
+    for (int64_t dy = -r; dy <= r; ++dy) {
+        for (int64_t dx = -r; dx <= r; ++dx) {
+            if (neighborhood_contains(rule.neighborhood, dx, dy)) {
+                rt->offsets[rt->num_offsets++] = (ptrdiff_t)dy * (ptrdiff_t)rt->live->stride + (ptrdiff_t)dx;
+            }
+        }
+    }
+
+    size_t padded_size = rt->live->stride * (rt->live->height + 2 * radius);
+    rt->region_mark = calloc(padded_size, sizeof(uint8_t));
+    rt->region_counts = calloc(padded_size, sizeof(uint8_t));
+    rt->region = new_stack(128);
+    rt->worklist = new_stack(128);
+    return rt;
+}
+
+size_t roll_tracker_part1(const struct roll_tracker* const rt) { return rt->accessible; }
+
+size_t roll_tracker_part2(const struct roll_tracker* const rt) { return rt->num_rolls - rt->num_core; }
+
+static size_t roll_tracker_neighbor(const struct roll_tracker* const rt, size_t index, size_t k)
+{
+    return (size_t)((ptrdiff_t)index + rt->offsets[k]);
+}
+
+static size_t roll_tracker_index(const struct roll_tracker* const rt, size_t x, size_t y)
+{
+    if (x >= rt->live->width || y >= rt->live->height) {
+        fprintf(stderr, "Roll coordinates out of range: (%zu, %zu)\n", x, y);
+        abort();
+    }
+    return stencil_index(rt->live, x, y);
+}
+
+static void roll_tracker_join_core(struct roll_tracker* rt, size_t index)
+{
+    rt->core->cells[index] = 1;
+    ++rt->num_core;
+    for (size_t k = 0; k < rt->num_offsets; ++k) {
+        ++rt->core->counts[roll_tracker_neighbor(rt, index, k)];
+    }
+}
+
+static void roll_tracker_leave_core(struct roll_tracker* rt, size_t index)
+{
+    uint8_t threshold = rt->rule.threshold;
+    stack_clear(rt->worklist);
+    rt->core->cells[index] = 0;
+    stack_push(rt->worklist, index);
+
+    while (!stack_is_empty(rt->worklist)) {
+        size_t i = stack_pop(rt->worklist);
+        --rt->num_core;
+        for (size_t k = 0; k < rt->num_offsets; ++k) {
+            size_t n = roll_tracker_neighbor(rt, i, k);
+            --rt->core->counts[n];
+            if (rt->core->cells[n] && rt->core->counts[n] < threshold) {
+                rt->core->cells[n] = 0;
+                stack_push(rt->worklist, n);
+            }
+        }
+    }
+}
+
+// Collects the rolls outside the core that are connected to `index` through other such rolls, then peels them with
+// the core as fixed support. Whatever survives joins the core.
+static void roll_tracker_grow_core(struct roll_tracker* rt, size_t index)
+{
+    uint8_t threshold = rt->rule.threshold;
+    stack_clear(rt->region);
+    stack_clear(rt->worklist);
+    rt->region_mark[index] = REGION_CANDIDATE;
+    stack_push(rt->region, index);
+    for (size_t r = 0; r < rt->region->size; ++r) {
+        size_t i = rt->region->items[r];
+        for (size_t k = 0; k < rt->num_offsets; ++k) {
+            size_t n = roll_tracker_neighbor(rt, i, k);
+            if (rt->live->cells[n] && !rt->core->cells[n] && rt->region_mark[n] == REGION_OUTSIDE) {
+                rt->region_mark[n] = REGION_CANDIDATE;
+                stack_push(rt->region, n);
+            }
+        }
+    }
+
+    for (size_t r = 0; r < rt->region->size; ++r) {
+        size_t i = rt->region->items[r];
+        uint8_t count = rt->core->counts[i];
+        for (size_t k = 0; k < rt->num_offsets; ++k) {
+            count = (uint8_t)(count + (rt->region_mark[roll_tracker_neighbor(rt, i, k)] == REGION_CANDIDATE));
+        }
+        rt->region_counts[i] = count;
+    }
+    for (size_t r = 0; r < rt->region->size; ++r) {
+        size_t i = rt->region->items[r];
+        if (rt->region_counts[i] < threshold) {
+            rt->region_mark[i] = REGION_PEELED;
+            stack_push(rt->worklist, i);
+        }
+    }
+
+    while (!stack_is_empty(rt->worklist)) {
+        size_t i = stack_pop(rt->worklist);
+        for (size_t k = 0; k < rt->num_offsets; ++k) {
+            size_t n = roll_tracker_neighbor(rt, i, k);
+            if (rt->region_mark[n] == REGION_CANDIDATE) {
+                --rt->region_counts[n];
+                if (rt->region_counts[n] < threshold) {
+                    rt->region_mark[n] = REGION_PEELED;
+                    stack_push(rt->worklist, n);
+                }
+            }
+        }
+    }
+
+    for (size_t r = 0; r < rt->region->size; ++r) {
+        size_t i = rt->region->items[r];
+        if (rt->region_mark[i] == REGION_CANDIDATE) {
+            roll_tracker_join_core(rt, i);
+        }
+        rt->region_mark[i] = REGION_OUTSIDE;
+    }
+}
+
+void roll_tracker_add(struct roll_tracker* rt, size_t x, size_t y)
+{
+    size_t index = roll_tracker_index(rt, x, y);
+    if (rt->live->cells[index]) {
+        return;
+    }
+    uint8_t threshold = rt->rule.threshold;
+
+    rt->live->cells[index] = 1;
+    ++rt->num_rolls;
+    if (rt->live->counts[index] < threshold) {
+        ++rt->accessible;
+    }
+    for (size_t k = 0; k < rt->num_offsets; ++k) {
+        size_t n = roll_tracker_neighbor(rt, index, k);
+        ++rt->live->counts[n];
+        if (rt->live->cells[n] && rt->live->counts[n] == threshold) {
+            --rt->accessible;
+        }
+    }
+
+    roll_tracker_grow_core(rt, index);
+}
+
+void roll_tracker_remove(struct roll_tracker* rt, size_t x, size_t y)
+{
+    size_t index = roll_tracker_index(rt, x, y);
+    if (!rt->live->cells[index]) {
+        return;
+    }
+    uint8_t threshold = rt->rule.threshold;
+
+    rt->live->cells[index] = 0;
+    --rt->num_rolls;
+    if (rt->live->counts[index] < threshold) {
+        --rt->accessible;
+    }
+    for (size_t k = 0; k < rt->num_offsets; ++k) {
+        size_t n = roll_tracker_neighbor(rt, index, k);
+        --rt->live->counts[n];
+        if (rt->live->cells[n] && rt->live->counts[n] + 1 == threshold) {
+            ++rt->accessible;
+        }
+    }
+
+    if (rt->core->cells[index]) {
+        roll_tracker_leave_core(rt, index);
+    }
+}
+
+static void stencil_count_row(enum neighborhood nh, const uint8_t* const* rows, size_t width, uint8_t* out)
+{
+    switch (nh) {
+    case NEIGHBORHOOD_VON_NEUMANN:
+        von_neumann_count_row(rows, width, out);
+        return;
+    case NEIGHBORHOOD_MOORE:
+        moore_count_row(rows, width, out);
+        return;
+    case NEIGHBORHOOD_MOORE_R2:
+        moore_r2_count_row(rows, width, out);
+        return;
+    }
+}
+
+// Part 1 over a stream of rows, keeping only the 2R+1 most recent rows (three for the puzzle rule). A row's count is
+// final once the R rows below it have arrived, so `accessible` is a running total over the first `rows_done` rows and
+// trails the input by R rows.
+struct roll_stream {
+    struct stencil_rule rule;
+    size_t radius;
+    size_t window;
+    size_t width;
+    size_t stride;
+    size_t rows_seen;
+    size_t rows_done;
+    size_t accessible;
+    uint8_t* ring;
+    uint8_t* empty_row;
+    uint8_t* counts;
+};
+
+struct roll_stream* new_roll_stream(struct stencil_rule rule)
+{
+    struct roll_stream* rs = malloc(sizeof(struct roll_stream));
+    size_t radius = neighborhood_radius(rule.neighborhood);
+    *rs = (struct roll_stream) { .rule = rule, .radius = radius, .window = 2 * radius + 1 };
+    return rs;
+}
+
+void free_roll_stream(struct roll_stream* rs)
+{
+    if (rs) {
+        free(rs->ring);
+        free(rs->empty_row);
+        free(rs->counts);
+        free(rs);
+    }
+}
+
+static const uint8_t* roll_stream_row(const struct roll_stream* const rs, int64_t y)
+{
+    if (y < 0 || (size_t)y >= rs->rows_seen) {
+        return rs->empty_row + rs->radius;
+    }
+    return &rs->ring[((size_t)y % rs->window) * rs->stride + rs->radius];
+}
+
+// Finalizes row y, whose neighbours must all have arrived (or be past the end of the input).
+static size_t roll_stream_finalize_row(struct roll_stream* rs, int64_t y)
+{
+    const uint8_t* rows[2 * MAX_STENCIL_RADIUS + 1];
+    for (size_t k = 0; k < rs->window; ++k) {
+        rows[k] = roll_stream_row(rs, y + (int64_t)k - (int64_t)rs->radius);
+    }
+    stencil_count_row(rs->rule.neighborhood, rows, rs->width, rs->counts);
+
+    const uint8_t* cell_row = rows[rs->radius];
     size_t count = 0;
-    while (!stack_is_empty(removeables)) {
-        size_t index = stack_pop(removeables);
-        rg_copy->rolls[index] = false;
-        ++count;
+    for (size_t x = 0; x < rs->width; ++x) {
+        count += (cell_row[x] & (rs->counts[x] < rs->rule.threshold));
+    }
+    rs->accessible += count;
+    rs->rows_done = (size_t)y + 1;
+    return count;
+}
+
+// Adds one row of '@'/'.' characters and returns the number of accessible rolls in the row that it completes.
+size_t roll_stream_push_row(struct roll_stream* rs, const char* line, size_t len)
+{
+    if (rs->rows_seen == 0) {
+        rs->width = len;
+        rs->stride = len + 2 * rs->radius;
+        rs->ring = calloc(rs->window * rs->stride, sizeof(uint8_t));
+        rs->empty_row = calloc(rs->stride, sizeof(uint8_t));
+        rs->counts = malloc(len * sizeof(uint8_t));
+    } else if (len != rs->width) {
+        fprintf(stderr, "Inconsistent width: %zu vs %zu\n", rs->width, len);
+        abort();
+    }
+
+    uint8_t* row = &rs->ring[(rs->rows_seen % rs->window) * rs->stride + rs->radius];
+    for (size_t i = 0; i < len; ++i) {
+        if (line[i] == '@') {
+            row[i] = 1;
+        } else if (line[i] == '.') {
+            row[i] = 0;
+        } else {
+            fprintf(stderr, "Invalid character in roll data: %c\n", line[i]);
+            abort();
+        }
+    }
+    ++rs->rows_seen;
+
+    int64_t complete = (int64_t)rs->rows_seen - 1 - (int64_t)rs->radius;
+    if (complete < 0) {
+        return 0;
+    }
+    return roll_stream_finalize_row(rs, complete);
+}
+
+// Once the input has ended, finalizes the next of the last R rows. Returns false when every row is final.
+bool roll_stream_finish_row(struct roll_stream* rs)
+{
+    if (rs->rows_done == rs->rows_seen) {
+        return false;
     }
-    count += part2_greedy(rg_copy);
+    roll_stream_finalize_row(rs, (int64_t)rs->rows_done);
+    return true;
+}
+
+// With `output`, the running total is written and flushed each time a row is finalized, so a consumer sees counts
+// while rows are still arriving.
+size_t part1_streaming(FILE* stream, struct stencil_rule rule, FILE* output)
+{
+    struct roll_stream* rs = new_roll_stream(rule);
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+    while ((line_length = getline(&line, &line_capacity, stream)) > 0) {
+        size_t len = (size_t)line_length;
+        if (line[len - 1] == '\n') {
+            --len;
+        }
+        if (len == 0) {
+            break;
+        }
+        size_t rows_done = rs->rows_done;
+        roll_stream_push_row(rs, line, len);
+        if (output && rs->rows_done != rows_done) {
+            fprintf(output, "%zu\n", rs->accessible);
+            fflush(output);
+        }
+    }
+    free(line);
 
-    free_stack(removeables);
-    free_roll_grid(rg_copy);
+    while (roll_stream_finish_row(rs)) {
+        if (output) {
+            fprintf(output, "%zu\n", rs->accessible);
+            fflush(output);
+        }
+    }
+    size_t count = rs->accessible;
+    free_roll_stream(rs);
     return count;
 }
 
+size_t part2_greedy(const struct roll_grid* const rg)
+{
+    return stencil_peel(rg, puzzle_rule);
+}
 
 void part2(const struct roll_grid* const rg)
 {
-    size_t p2_count = part2_greedy(rg);
+    // DAY4_PEEL_TRACE=csv or DAY4_PEEL_TRACE=json dumps the per-round peel records after the answer
+    const char* trace_format = getenv("DAY4_PEEL_TRACE");
+    if (!trace_format) {
+        size_t p2_count = part2_greedy(rg);
+        printf("Part 2: %zu\n", p2_count);
+        return;
+    }
+
+    struct peel_trace* trace = new_peel_trace();
+    size_t p2_count = stencil_peel_traced(rg, puzzle_rule, trace);
     printf("Part 2: %zu\n", p2_count);
+    if (strcmp(trace_format, "json") == 0) {
+        peel_trace_write_json(trace, stdout);
+    } else {
+        peel_trace_write_csv(trace, stdout);
+    }
+    free_peel_trace(trace);
 }
 
 void part1(const struct roll_grid* const rg)
 {
-    uint8_t* conv_res = count_adjacent(rg);
-    size_t width = rg->width;
-    size_t height = rg->height;
-
-    size_t p1_count = 0;
-    for (size_t y = 0; y < height; ++y) {
-        uint8_t* conv_row = &conv_res[y * width];
-        bool* roll_row = &rg->rolls[y * width];
-        for (size_t x = 0; x < width; ++x) {
-            if (roll_row[x] && conv_row[x] < 4) {
-                ++p1_count;
-                conv_row[x] = 10;
-            }
+    size_t p1_count = stencil_count_accessible(rg, puzzle_rule);
+    printf("Part 1: %zu\n", p1_count);
+}
+
+// With `running_counts`, the running part 1 total is printed for every completed row before the answer.
+void stream_and_run(FILE* input_stream, bool running_counts)
+{
+    size_t p1_count = part1_streaming(input_stream, puzzle_rule, running_counts ? stdout : NULL);
+    printf("Part 1 (streaming): %zu\n", p1_count);
+}
+
+static const struct stencil_rule self_check_rules[] = {
+    { .neighborhood = NEIGHBORHOOD_VON_NEUMANN, .threshold = 2 },
+    { .neighborhood = NEIGHBORHOOD_VON_NEUMANN, .threshold = 3 },
+    { .neighborhood = NEIGHBORHOOD_MOORE, .threshold = 4 },
+    { .neighborhood = NEIGHBORHOOD_MOORE, .threshold = 6 },
+    { .neighborhood = NEIGHBORHOOD_MOORE_R2, .threshold = 8 },
+    { .neighborhood = NEIGHBORHOOD_MOORE_R2, .threshold = 13 },
+};
+#define NUM_SELF_CHECK_RULES (sizeof(self_check_rules) / sizeof(self_check_rules[0]))
+
+// Both backends must agree on both parts, whichever one the grid was parsed into.
+bool check_sparse_backend(const struct roll_grid* const rg)
+{
+    bool ok = true;
+    for (size_t r = 0; r < NUM_SELF_CHECK_RULES; ++r) {
+        struct stencil_rule rule = self_check_rules[r];
+        ok &= sparse_count_accessible(rg, rule) == dense_count_accessible(rg, rule);
+        ok &= sparse_peel(rg, rule, NULL, NULL) == dense_peel(rg, rule, NULL, NULL);
+    }
+    return ok;
+}
+
+// The first round of the layers is part 1 and everything peeled eventually is part 2.
+bool check_peel_layers(const struct roll_grid* const rg)
+{
+    bool ok = true;
+    for (size_t r = 0; r < NUM_SELF_CHECK_RULES; ++r) {
+        struct stencil_rule rule = self_check_rules[r];
+        struct peel_layers* pl = new_peel_layers(rg, rule);
+        ok &= peel_layers_removed_after(pl, 1) == stencil_count_accessible(rg, rule);
+        ok &= peel_layers_removed_after(pl, pl->num_rounds) == stencil_peel(rg, rule);
+        free_peel_layers(pl);
+    }
+    return ok;
+}
+
+#define TRACKER_CHECK_STEPS 64
+
+// Toggles pseudo-random cells through the tracker and through a plain grid, recomputing both parts from scratch
+// after every step.
+bool check_roll_tracker(const struct roll_grid* const rg)
+{
+    if (rg->width == 0 || rg->height == 0) {
+        return true;
+    }
+    struct roll_grid* grid = new_roll_grid(rg->width, rg->height);
+    for (size_t y = 0; y < rg->height; ++y) {
+        for (size_t x = 0; x < rg->width; ++x) {
+            grid->rolls[y * rg->width + x] = get_roll(rg, x, y);
         }
     }
 
-    printf("Part 1: %zu\n", p1_count);
+    struct roll_tracker* rt = new_roll_tracker(rg, puzzle_rule);
+    bool ok = roll_tracker_part1(rt) == stencil_count_accessible(grid, puzzle_rule)
+        && roll_tracker_part2(rt) == stencil_peel(grid, puzzle_rule);
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for (size_t step = 0; step < TRACKER_CHECK_STEPS && ok; ++step) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        size_t x = (size_t)(state >> 33) % rg->width;
+        size_t y = (size_t)(state >> 17) % rg->height;
+        bool* cell = &grid->rolls[y * rg->width + x];
+        if (*cell) {
+            roll_tracker_remove(rt, x, y);
+        } else {
+            roll_tracker_add(rt, x, y);
+        }
+        *cell = !*cell;
+        ok = roll_tracker_part1(rt) == stencil_count_accessible(grid, puzzle_rule)
+            && roll_tracker_part2(rt) == stencil_peel(grid, puzzle_rule);
+    }
+
+    free_roll_tracker(rt);
+    free_roll_grid(grid);
+    return ok;
+}
 
-    free(conv_res);
+// The checks recompute everything several times over, so they are only meant for small grids like the sample.
+bool self_check(const struct roll_grid* const rg)
+{
+    bool sparse_ok = check_sparse_backend(rg);
+    bool layers_ok = check_peel_layers(rg);
+    bool tracker_ok = check_roll_tracker(rg);
+    printf("Self-check (sparse backend): %s\n", sparse_ok ? "ok" : "FAILED");
+    printf("Self-check (peel layers): %s\n", layers_ok ? "ok" : "FAILED");
+    printf("Self-check (roll tracker): %s\n", tracker_ok ? "ok" : "FAILED");
+    return sparse_ok && layers_ok && tracker_ok;
 }
 
-void parse_and_run(FILE* input_stream)
+// Returns false if `run_self_check` is set and a check failed.
+bool parse_and_run(FILE* input_stream, bool run_self_check)
 {
     struct roll_grid* rg = parse_roll_grid(input_stream);
     part1(rg);
     part2(rg);
+    bool ok = !run_self_check || self_check(rg);
 
     free_roll_grid(rg);
+    return ok;
 }
 
-int main()
+int main(int argc, char** argv)
 {
+    // Part 1 over a grid on stdin, one row at a time, without loading the whole grid, printing the running count as
+    // each row completes
+    if (argc > 1 && strcmp(argv[1], "--stream") == 0) {
+        stream_and_run(stdin, true);
+        return 0;
+    }
+
     printf("Test Input:\n");
     const char* test_input = "..@@.@@@@.\n"
                              "@@@.@.@.@@\n"
@@ -337,7 +1565,9 @@ int main()
                              "@.@.@@@.@.";
 
     FILE* test_stream = fmemopen((void*)test_input, strlen(test_input), "r");
-    parse_and_run(test_stream);
+    bool checks_ok = parse_and_run(test_stream, true);
+    rewind(test_stream);
+    stream_and_run(test_stream, false);
     fclose(test_stream);
 
      printf("Real Input:\n");
@@ -347,8 +1577,10 @@ int main()
          perror("Failed to open input file");
          return 1;
      }
-     parse_and_run(real_input_stream);
+     parse_and_run(real_input_stream, false);
+     rewind(real_input_stream);
+     stream_and_run(real_input_stream, false);
      fclose(real_input_stream);
 
-    return 0;
+    return checks_ok ? 0 : 1;
 }
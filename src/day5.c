@@ -1,35 +1,33 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 struct range {
     uint64_t start;
     uint64_t end;
 };
 
+struct packed_ranges;
+struct roaring_set;
+
 struct ingredients {
     struct range* fresh_ranges;
     uint64_t* required;
 
     size_t num_fresh_ranges;
     size_t num_required;
-};
-
-int range_start_comp(const void* a, const void* b)
-{
-    const struct range* ra = (const struct range*)a;
-    const struct range* rb = (const struct range*)b;
 
-    if (ra->start < rb->start) {
-        return -1;
-    } else if (ra->start > rb->start) {
-        return 1;
-    } else {
-        return 0;
-    }
-}
+    // Set by select_fresh_backend when the ranges are better kept compressed or as a bitmap. At most one is set, and
+    // it replaces the ranges: fresh_ranges is released and num_fresh_ranges is 0
+    struct packed_ranges* packed;
+    struct roaring_set* roaring;
+};
 
 int range_start_val_comp(const void* val, const void* range)
 {
@@ -73,8 +71,421 @@ void* upper_bound(const void* key, const void* base, size_t nmemb, size_t size,
 }
 
 
+// Fresh IDs as a roaring-style bitmap: IDs are split into 2^16-wide chunks by their high 48 bits, and each chunk that
+// has any fresh IDs gets the smallest of three containers for its low 16 bits: a sorted array of values, a 65536-bit
+// bitmap, or a sorted list of runs. Short, dense ranges pack far tighter than 16-byte struct ranges, and membership is
+// a search over the chunk keys followed by one container probe.
+#define ROARING_CHUNK_BITS 16
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_BITMAP_WORDS 1024
+
+enum container_kind {
+    CONTAINER_ARRAY,
+    CONTAINER_BITMAP,
+    CONTAINER_RUN,
+};
+
+struct roaring_container {
+    enum container_kind kind;
+    uint32_t size;
+    uint16_t* values;
+    uint64_t* bitmap;
+};
+
+struct roaring_set {
+    size_t num_containers;
+    size_t capacity;
+    uint64_t* keys;
+    struct roaring_container* containers;
+    uint64_t cardinality;
+};
+
+struct run16 {
+    uint16_t start;
+    uint16_t last;
+};
+
+void free_roaring_set(struct roaring_set* rs)
+{
+    if (rs) {
+        for (size_t i = 0; i < rs->num_containers; ++i) {
+            free(rs->containers[i].values);
+            free(rs->containers[i].bitmap);
+        }
+        free(rs->keys);
+        free(rs->containers);
+        free(rs);
+    }
+}
+
+static enum container_kind cheapest_container(uint64_t cardinality, size_t runs, size_t* bytes)
+{
+    size_t run_bytes = runs * sizeof(struct run16);
+    size_t bitmap_bytes = ROARING_BITMAP_WORDS * sizeof(uint64_t);
+    size_t array_bytes = cardinality <= ROARING_ARRAY_MAX ? cardinality * sizeof(uint16_t) : SIZE_MAX;
+    if (run_bytes <= array_bytes && run_bytes <= bitmap_bytes) {
+        *bytes = run_bytes;
+        return CONTAINER_RUN;
+    }
+    if (array_bytes <= bitmap_bytes) {
+        *bytes = array_bytes;
+        return CONTAINER_ARRAY;
+    }
+    *bytes = bitmap_bytes;
+    return CONTAINER_BITMAP;
+}
+
+static void roaring_add_container(struct roaring_set* rs, uint64_t key, const struct run16* runs, size_t num_runs)
+{
+    uint64_t cardinality = 0;
+    for (size_t i = 0; i < num_runs; ++i) {
+        cardinality += (uint64_t)(runs[i].last - runs[i].start) + 1;
+    }
+    size_t bytes;
+    struct roaring_container c = { .kind = cheapest_container(cardinality, num_runs, &bytes) };
+    if (c.kind == CONTAINER_RUN) {
+        c.size = (uint32_t)num_runs;
+        c.values = malloc(bytes);
+        memcpy(c.values, runs, bytes);
+    } else if (c.kind == CONTAINER_ARRAY) {
+        c.size = (uint32_t)cardinality;
+        c.values = malloc(bytes);
+        size_t k = 0;
+        for (size_t i = 0; i < num_runs; ++i) {
+            for (uint32_t v = runs[i].start; v <= runs[i].last; ++v) {
+                c.values[k++] = (uint16_t)v;
+            }
+        }
+    } else {
+        c.size = (uint32_t)cardinality;
+        c.bitmap = calloc(ROARING_BITMAP_WORDS, sizeof(uint64_t));
+        for (size_t i = 0; i < num_runs; ++i) {
+            for (uint32_t v = runs[i].start; v <= runs[i].last; ++v) {
+                c.bitmap[v / 64] |= (uint64_t)1 << (v % 64);
+            }
+        }
+    }
+
+    if (rs->num_containers >= rs->capacity) {
+        rs->capacity = rs->capacity ? rs->capacity * 2 : 16;
+        rs->keys = realloc(rs->keys, rs->capacity * sizeof(uint64_t));
+        rs->containers = realloc(rs->containers, rs->capacity * sizeof(struct roaring_container));
+    }
+    rs->keys[rs->num_containers] = key;
+    rs->containers[rs->num_containers] = c;
+    ++rs->num_containers;
+    rs->cardinality += cardinality;
+}
+
+struct roaring_walk {
+    struct roaring_set* rs;
+    struct run16* runs;
+    size_t num_runs;
+    uint64_t cardinality;
+    uint64_t key;
+    size_t bytes;
+};
+
+static const size_t roaring_container_overhead = sizeof(uint64_t) + sizeof(struct roaring_container);
+
+static void roaring_walk_flush(struct roaring_walk* w)
+{
+    if (w->num_runs > 0) {
+        size_t container_bytes;
+        cheapest_container(w->cardinality, w->num_runs, &container_bytes);
+        w->bytes += roaring_container_overhead + container_bytes;
+        if (w->rs) {
+            roaring_add_container(w->rs, w->key, w->runs, w->num_runs);
+        }
+    }
+    w->num_runs = 0;
+    w->cardinality = 0;
+}
+
+static void roaring_walk_add(struct roaring_walk* w, uint64_t key, uint64_t start, uint64_t last)
+{
+    if (key != w->key) {
+        roaring_walk_flush(w);
+        w->key = key;
+    }
+    const uint64_t low_mask = ((uint64_t)1 << ROARING_CHUNK_BITS) - 1;
+    w->runs[w->num_runs++]
+        = (struct run16) { .start = (uint16_t)(start & low_mask), .last = (uint16_t)(last & low_mask) };
+    w->cardinality += last - start + 1;
+}
+
+// Walks merged ranges chunk by chunk and returns what the containers cost. With `rs` null it only adds up the cost;
+// otherwise it also builds them. Chunks that a range covers completely are a single run each, so when only
+// estimating they are counted without being visited.
+static size_t roaring_walk(const struct ingredients* ing, struct roaring_set* rs)
+{
+    // merged ranges are at least two apart, so no chunk has more runs than this
+    size_t max_runs = (size_t)1 << (ROARING_CHUNK_BITS - 1);
+    struct roaring_walk w = { .rs = rs, .runs = malloc(max_runs * sizeof(struct run16)) };
+
+    for (size_t i = 0; i < ing->num_fresh_ranges; ++i) {
+        uint64_t start = ing->fresh_ranges[i].start;
+        uint64_t end = ing->fresh_ranges[i].end;
+        uint64_t lo_key = start >> ROARING_CHUNK_BITS;
+        uint64_t hi_key = end >> ROARING_CHUNK_BITS;
+        if (lo_key == hi_key) {
+            roaring_walk_add(&w, lo_key, start, end);
+            continue;
+        }
+
+        uint64_t low_mask = ((uint64_t)1 << ROARING_CHUNK_BITS) - 1;
+        roaring_walk_add(&w, lo_key, start, start | low_mask);
+        roaring_walk_flush(&w);
+        w.bytes += (hi_key - lo_key - 1) * (roaring_container_overhead + sizeof(struct run16));
+        if (rs) {
+            struct run16 whole = { .start = 0, .last = (uint16_t)low_mask };
+            for (uint64_t full = lo_key + 1; full < hi_key; ++full) {
+                roaring_add_container(rs, full, &whole, 1);
+            }
+        }
+        roaring_walk_add(&w, hi_key, end & ~low_mask, end);
+    }
+    roaring_walk_flush(&w);
+
+    free(w.runs);
+    return w.bytes;
+}
+
+struct roaring_set* new_roaring_set(const struct ingredients* ing)
+{
+    struct roaring_set* rs = calloc(1, sizeof(struct roaring_set));
+    roaring_walk(ing, rs);
+    return rs;
+}
+
+bool roaring_contains(const struct roaring_set* rs, uint64_t value)
+{
+    uint64_t key = value >> ROARING_CHUNK_BITS;
+    size_t l = 0;
+    size_t u = rs->num_containers;
+    while (l < u) {
+        size_t mid = (l + u) / 2;
+        if (rs->keys[mid] < key) {
+            l = mid + 1;
+        } else {
+            u = mid;
+        }
+    }
+    if (l == rs->num_containers || rs->keys[l] != key) {
+        return false;
+    }
+
+    const struct roaring_container* c = &rs->containers[l];
+    uint16_t low = (uint16_t)(value & (((uint64_t)1 << ROARING_CHUNK_BITS) - 1));
+    if (c->kind == CONTAINER_BITMAP) {
+        return (c->bitmap[low / 64] >> (low % 64)) & 1;
+    }
+
+    // first array value / run start above `low`
+    const struct run16* runs = (const struct run16*)c->values;
+    l = 0;
+    u = c->size;
+    while (l < u) {
+        size_t mid = (l + u) / 2;
+        uint16_t probe = c->kind == CONTAINER_ARRAY ? c->values[mid] : runs[mid].start;
+        if (probe <= low) {
+            l = mid + 1;
+        } else {
+            u = mid;
+        }
+    }
+    if (l == 0) {
+        return false;
+    }
+    if (c->kind == CONTAINER_ARRAY) {
+        return c->values[l - 1] == low;
+    }
+    return low <= runs[l - 1].last;
+}
+
+// Merged ranges compressed in blocks of PACKED_BLOCK_RANGES. Within a block every range after the first is stored as
+// the gap from the previous end (minus the 2 that merging guarantees) and every range as its length minus one, each
+// bit-packed at the narrowest width that fits the block. The first start of each block is kept uncompressed in
+// `block_starts`, which is the skip index a lookup binary-searches before decoding a single block.
+#define PACKED_BLOCK_RANGES 128
+
+struct packed_block {
+    uint64_t bit_offset;
+    uint16_t count;
+    uint8_t gap_bits;
+    uint8_t length_bits;
+};
+
+struct packed_ranges {
+    size_t num_ranges;
+    size_t num_blocks;
+    uint64_t* block_starts;
+    struct packed_block* blocks;
+    uint64_t* bits;
+    size_t num_words;
+};
+
+void free_packed_ranges(struct packed_ranges* pr)
+{
+    if (pr) {
+        free(pr->block_starts);
+        free(pr->blocks);
+        free(pr->bits);
+        free(pr);
+    }
+}
+
+static uint8_t bit_width(uint64_t value) { return value ? (uint8_t)(64 - __builtin_clzll(value)) : 0; }
+
+static void write_bits(uint64_t* bits, size_t pos, uint8_t width, uint64_t value)
+{
+    if (width == 0) {
+        return;
+    }
+    size_t word = pos / 64;
+    size_t offset = pos % 64;
+    bits[word] |= value << offset;
+    if (offset + width > 64) {
+        bits[word + 1] |= value >> (64 - offset);
+    }
+}
+
+static uint64_t read_bits(const uint64_t* bits, size_t pos, uint8_t width)
+{
+    if (width == 0) {
+        return 0;
+    }
+    size_t word = pos / 64;
+    size_t offset = pos % 64;
+    uint64_t value = bits[word] >> offset;
+    if (offset + width > 64) {
+        value |= bits[word + 1] << (64 - offset);
+    }
+    return width == 64 ? value : value & (((uint64_t)1 << width) - 1);
+}
+
+// Builds the compressed form from ranges that have been through sort_ranges.
+struct packed_ranges* new_packed_ranges(const struct ingredients* ing)
+{
+    const struct range* ranges = ing->fresh_ranges;
+    size_t n = ing->num_fresh_ranges;
+    struct packed_ranges* pr = malloc(sizeof(struct packed_ranges));
+    pr->num_ranges = n;
+    pr->num_blocks = (n + PACKED_BLOCK_RANGES - 1) / PACKED_BLOCK_RANGES;
+    pr->block_starts = malloc(pr->num_blocks * sizeof(uint64_t));
+    pr->blocks = malloc(pr->num_blocks * sizeof(struct packed_block));
+
+    size_t total_bits = 0;
+    for (size_t b = 0; b < pr->num_blocks; ++b) {
+        size_t first = b * PACKED_BLOCK_RANGES;
+        size_t last = first + PACKED_BLOCK_RANGES < n ? first + PACKED_BLOCK_RANGES : n;
+        uint64_t max_gap = 0;
+        uint64_t max_length = 0;
+        for (size_t i = first; i < last; ++i) {
+            if (i > first && ranges[i].start - ranges[i - 1].end - 2 > max_gap) {
+                max_gap = ranges[i].start - ranges[i - 1].end - 2;
+            }
+            if (ranges[i].end - ranges[i].start > max_length) {
+                max_length = ranges[i].end - ranges[i].start;
+            }
+        }
+        pr->block_starts[b] = ranges[first].start;
+        pr->blocks[b] = (struct packed_block) {
+            .bit_offset = total_bits,
+            .count = (uint16_t)(last - first),
+            .gap_bits = bit_width(max_gap),
+            .length_bits = bit_width(max_length),
+        };
+        total_bits += (last - first) * pr->blocks[b].length_bits + (last - first - 1) * pr->blocks[b].gap_bits;
+    }
+
+    pr->num_words = total_bits / 64 + 1;
+    pr->bits = calloc(pr->num_words, sizeof(uint64_t));
+    for (size_t b = 0; b < pr->num_blocks; ++b) {
+        const struct packed_block* block = &pr->blocks[b];
+        size_t first = b * PACKED_BLOCK_RANGES;
+        size_t pos = block->bit_offset;
+        for (size_t i = first; i < first + block->count; ++i) {
+            if (i > first) {
+                write_bits(pr->bits, pos, block->gap_bits, ranges[i].start - ranges[i - 1].end - 2);
+                pos += block->gap_bits;
+            }
+            write_bits(pr->bits, pos, block->length_bits, ranges[i].end - ranges[i].start);
+            pos += block->length_bits;
+        }
+    }
+    return pr;
+}
+
+size_t packed_ranges_bytes(const struct packed_ranges* pr)
+{
+    return pr->num_blocks * (sizeof(uint64_t) + sizeof(struct packed_block)) + pr->num_words * sizeof(uint64_t);
+}
+
+bool packed_ranges_contains(const struct packed_ranges* pr, uint64_t value)
+{
+    // last block whose first start is <= value
+    size_t l = 0;
+    size_t u = pr->num_blocks;
+    while (l < u) {
+        size_t mid = (l + u) / 2;
+        if (pr->block_starts[mid] <= value) {
+            l = mid + 1;
+        } else {
+            u = mid;
+        }
+    }
+    if (l == 0) {
+        return false;
+    }
+
+    const struct packed_block* block = &pr->blocks[l - 1];
+    size_t pos = block->bit_offset;
+    uint64_t start = pr->block_starts[l - 1];
+    for (size_t i = 0; i < block->count; ++i) {
+        if (i > 0) {
+            start += read_bits(pr->bits, pos, block->gap_bits) + 2;
+            pos += block->gap_bits;
+            if (start > value) {
+                return false;
+            }
+        }
+        uint64_t end = start + read_bits(pr->bits, pos, block->length_bits);
+        pos += block->length_bits;
+        if (value <= end) {
+            return true;
+        }
+        start = end;
+    }
+    return false;
+}
+
+// The part 2 answer, decoded from the lengths alone.
+uint64_t packed_ranges_covered(const struct packed_ranges* pr)
+{
+    uint64_t covered = 0;
+    for (size_t b = 0; b < pr->num_blocks; ++b) {
+        const struct packed_block* block = &pr->blocks[b];
+        size_t pos = block->bit_offset;
+        for (size_t i = 0; i < block->count; ++i) {
+            if (i > 0) {
+                pos += block->gap_bits;
+            }
+            covered += read_bits(pr->bits, pos, block->length_bits) + 1;
+            pos += block->length_bits;
+        }
+    }
+    return covered;
+}
+
 bool contained_in_range(const struct ingredients* ing, uint64_t value)
 {
+    if (ing->packed) {
+        return packed_ranges_contains(ing->packed, value);
+    }
+    if (ing->roaring) {
+        return roaring_contains(ing->roaring, value);
+    }
     void* maybe_matching
         = upper_bound(&value, ing->fresh_ranges, ing->num_fresh_ranges, sizeof(struct range), &range_start_val_comp);
 
@@ -105,154 +516,1563 @@ bool contained_in_range2(const struct ingredients* ing, uint64_t value) {
     return false;
 }
 
-void print_ingredients(const struct ingredients* ing)
-{
-    printf("Fresh Ranges: %lu\n", ing->num_fresh_ranges);
-    for (size_t i = 0; i < ing->num_fresh_ranges; ++i) {
-        printf("  %lu-%lu\n", ing->fresh_ranges[i].start, ing->fresh_ranges[i].end);
-    }
-
-    printf("Required Ingredients:\n");
-    for (size_t i = 0; i < ing->num_required; ++i) {
-        printf("  %lu\n", ing->required[i]);
-    }
-}
-
-void sort_ranges(struct ingredients* ing)
-{
-    if (ing->num_fresh_ranges < 2) {
-        return;
+// LSD radix sort on a 64-bit key, one byte per pass. All eight histograms come from a single read of the input and
+// passes where every key has the same byte are skipped, so small ID ranges only pay for the bytes that differ.
+// `scratch` must hold n items; the result always ends up back in `items`.
+#define DEFINE_RADIX_SORT(name, type, key_fn)                                                                          \
+    void name##_radix_sort(type* items, type* scratch, size_t n)                                                       \
+    {                                                                                                                  \
+        if (n < 2) {                                                                                                   \
+            return;                                                                                                    \
+        }                                                                                                              \
+        size_t counts[8][256] = { 0 };                                                                                 \
+        for (size_t i = 0; i < n; ++i) {                                                                               \
+            uint64_t key = key_fn(&items[i]);                                                                          \
+            for (size_t b = 0; b < 8; ++b) {                                                                           \
+                ++counts[b][(key >> (8 * b)) & 0xff];                                                                  \
+            }                                                                                                          \
+        }                                                                                                              \
+                                                                                                                       \
+        type* src = items;                                                                                             \
+        type* dst = scratch;                                                                                           \
+        uint64_t first_key = key_fn(&items[0]);                                                                        \
+        for (size_t b = 0; b < 8; ++b) {                                                                               \
+            size_t shift = 8 * b;                                                                                      \
+            if (counts[b][(first_key >> shift) & 0xff] == n) {                                                         \
+                continue;                                                                                              \
+            }                                                                                                          \
+            size_t offset = 0;                                                                                         \
+            for (size_t d = 0; d < 256; ++d) {                                                                         \
+                size_t c = counts[b][d];                                                                               \
+                counts[b][d] = offset;                                                                                 \
+                offset += c;                                                                                           \
+            }                                                                                                          \
+            for (size_t i = 0; i < n; ++i) {                                                                           \
+                dst[counts[b][(key_fn(&src[i]) >> shift) & 0xff]++] = src[i];                                          \
+            }                                                                                                          \
+            type* tmp = src;                                                                                           \
+            src = dst;                                                                                                 \
+            dst = tmp;                                                                                                 \
+        }                                                                                                              \
+        if (src != items) {                                                                                            \
+            memcpy(items, src, n * sizeof(type));                                                                      \
+        }                                                                                                              \
     }
 
-    qsort(ing->fresh_ranges, ing->num_fresh_ranges, sizeof(struct range), &range_start_comp);
+// An ingredient ID tagged with its position in the query list, so sorted results can be scattered back.
+struct keyed_id {
+    uint64_t value;
+    size_t index;
+};
 
-    size_t merged_count = 0;
+static inline uint64_t keyed_id_key(const struct keyed_id* k) { return k->value; }
 
-    struct range* merged_ranges = malloc(sizeof(struct range) * ing->num_fresh_ranges);
+DEFINE_RADIX_SORT(keyed_id, struct keyed_id, keyed_id_key)
 
-    for (size_t i = 0; i < ing->num_fresh_ranges - 1; ++i) {
-        size_t cur_merged_count = 0;
-        uint64_t start_to_write = ing->fresh_ranges[i].start;
-        uint64_t end_to_write = ing->fresh_ranges[i].end;
-        for (size_t j = i + 1; j < ing->num_fresh_ranges; ++j) {
-            uint64_t merge_candidate_start = ing->fresh_ranges[j].start;
-            uint64_t merge_candidate_end = ing->fresh_ranges[j].end;
-            if (merge_candidate_start <= end_to_write + 1) {
-                if (merge_candidate_end > end_to_write) {
-                    end_to_write = merge_candidate_end;
-                }
-                ++cur_merged_count;
-            } else {
-                break;
+// Answers membership for a whole batch of IDs by sorting them and walking them alongside the merged ranges, instead of
+// one binary search per ID. Returns how many are fresh; if `fresh` is non-null it gets the answer for each ID in the
+// original order. Needs the ranges to have been through sort_ranges.
+size_t contained_batch(const struct ingredients* ing, const uint64_t* ids, size_t n, bool* fresh)
+{
+    if (ing->packed || ing->roaring) {
+        // The sweep below needs the plain ranges; the other forms are answered one ID at a time
+        size_t count = 0;
+        for (size_t i = 0; i < n; ++i) {
+            bool contained = contained_in_range(ing, ids[i]);
+            count += contained;
+            if (fresh) {
+                fresh[i] = contained;
             }
         }
+        return count;
+    }
 
-        merged_ranges[merged_count] = (struct range) { .start = start_to_write, .end = end_to_write };
-        ++merged_count;
+    struct keyed_id* keyed = malloc(n * sizeof(struct keyed_id));
+    struct keyed_id* scratch = malloc(n * sizeof(struct keyed_id));
+    for (size_t i = 0; i < n; ++i) {
+        keyed[i] = (struct keyed_id) { .value = ids[i], .index = i };
+    }
+    keyed_id_radix_sort(keyed, scratch, n);
+    free(scratch);
 
-        i += cur_merged_count;
+    size_t count = 0;
+    size_t r = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t value = keyed[i].value;
+        while (r < ing->num_fresh_ranges && ing->fresh_ranges[r].end < value) {
+            ++r;
+        }
+        bool contained = r < ing->num_fresh_ranges && ing->fresh_ranges[r].start <= value;
+        count += contained;
+        if (fresh) {
+            fresh[keyed[i].index] = contained;
+        }
     }
 
-    ing->num_fresh_ranges = merged_count;
-    memcpy(ing->fresh_ranges, merged_ranges, sizeof(struct range) * merged_count);
-    free(merged_ranges);
+    free(keyed);
+    return count;
 }
 
-void free_ingredients(struct ingredients* ing)
-{
-    if (ing) {
-        free(ing->fresh_ranges);
-        free(ing->required);
-        free(ing);
-    }
-}
+// Read-only index over the merged range starts in a static B-tree layout: each node is one cache line of
+// RANGE_INDEX_B sorted starts, and node k's children are k * (B + 1) + 1 ... k * (B + 1) + B + 1, so the tree needs no
+// pointers. A lookup touches one line per level instead of one per binary-search step. Empty slots hold UINT64_MAX.
+#define RANGE_INDEX_B 8
+#define RANGE_INDEX_BATCH 16
 
-struct ingredients* parse_ingredients(FILE* input_stream)
-{
-    struct range* ranges = NULL;
-    size_t ranges_count = 0;
+// Baseline x86-64 has no 64-bit vector compare, so the lookups are also built for AVX2 and picked at load time.
+#if defined(__x86_64__)
+#define RANGE_INDEX_SIMD __attribute__((target_clones("avx2", "default")))
+#else
+#define RANGE_INDEX_SIMD
+#endif
 
-    char line_buffer[256];
+struct range_index_node {
+    uint64_t starts[RANGE_INDEX_B];
+} __attribute__((aligned(64)));
 
-    while (true) {
-        uint64_t start, end;
-        char* line_buffer_ret = fgets(line_buffer, sizeof(line_buffer), input_stream);
-        if (!line_buffer_ret || line_buffer[0] == '\n') {
-            break;
-        }
-        int scanf_ret = sscanf(line_buffer_ret, "%lu-%lu", &start, &end);
-        if (scanf_ret != 2) {
-            break;
-        }
+struct range_index {
+    size_t num_ranges;
+    size_t num_nodes;
+    size_t height;
+    struct range_index_node* nodes;
+    uint64_t* ends;
+    uint64_t last_end;
+};
 
-        ranges = realloc(ranges, sizeof(struct range) * (ranges_count + 1));
-        ranges[ranges_count] = (struct range) { .start = start, .end = end };
-        ++ranges_count;
+void free_range_index(struct range_index* ri)
+{
+    if (ri) {
+        free(ri->nodes);
+        free(ri->ends);
+        free(ri);
     }
+}
 
-    uint64_t* required_list = NULL;
-    size_t required_count = 0;
-    while (true) {
-        uint64_t required;
-        char* line_buffer_ret = fgets(line_buffer, sizeof(line_buffer), input_stream);
-        if (!line_buffer_ret || line_buffer[0] == '\n') {
-            break;
-        }
-
-        int scanf_ret = sscanf(line_buffer_ret, "%lu", &required);
+static size_t range_index_child(size_t node, size_t slot) { return node * (RANGE_INDEX_B + 1) + slot + 1; }
 
-        if (scanf_ret != 1) {
-            break;
+static void range_index_fill(struct range_index* ri, const struct range* ranges, size_t node, size_t* next)
+{
+    if (node >= ri->num_nodes) {
+        return;
+    }
+    for (size_t slot = 0; slot <= RANGE_INDEX_B; ++slot) {
+        range_index_fill(ri, ranges, range_index_child(node, slot), next);
+        if (slot < RANGE_INDEX_B && *next < ri->num_ranges) {
+            ri->nodes[node].starts[slot] = ranges[*next].start;
+            ri->ends[node * RANGE_INDEX_B + slot] = ranges[*next].end;
+            ++*next;
         }
+    }
+}
 
-        required_list = realloc(required_list, sizeof(uint64_t) * (required_count + 1));
-        required_list[required_count] = required;
-        ++required_count;
+// Builds the index from ranges that have been through sort_ranges.
+struct range_index* new_range_index(const struct ingredients* ing)
+{
+    struct range_index* ri = malloc(sizeof(struct range_index));
+    ri->num_ranges = ing->num_fresh_ranges;
+    ri->num_nodes = (ing->num_fresh_ranges + RANGE_INDEX_B - 1) / RANGE_INDEX_B;
+    ri->height = 0;
+    for (size_t covered = 0, level_nodes = 1; covered < ri->num_nodes; level_nodes *= RANGE_INDEX_B + 1) {
+        covered += level_nodes;
+        ++ri->height;
     }
+    ri->last_end = ing->num_fresh_ranges ? ing->fresh_ranges[ing->num_fresh_ranges - 1].end : 0;
 
-    struct ingredients* result = malloc(sizeof(struct ingredients));
-    *result = (struct ingredients) {
-        .fresh_ranges = ranges,
-        .required = required_list,
-        .num_fresh_ranges = ranges_count,
-        .num_required = required_count,
-    };
-    return result;
+    size_t nodes_size = (ri->num_nodes ? ri->num_nodes : 1) * sizeof(struct range_index_node);
+    ri->nodes = aligned_alloc(64, nodes_size);
+    memset(ri->nodes, 0xff, nodes_size);
+    ri->ends = calloc(ri->num_nodes * RANGE_INDEX_B + 1, sizeof(uint64_t));
+
+    size_t next = 0;
+    range_index_fill(ri, ing->fresh_ranges, 0, &next);
+    return ri;
 }
 
-void part1(const struct ingredients* const ing)
+// Number of starts in the node that are <= value. The fixed-length compare-and-add loop has no branches and compiles
+// to a vector compare and a horizontal sum.
+static inline size_t range_index_rank(const struct range_index_node* node, uint64_t value)
 {
-    size_t count = 0;
-    for (size_t i = 0; i < ing->num_required; ++i) {
-        if (contained_in_range(ing, ing->required[i])) {
-            ++count;
-        } else {
-        }
+    size_t rank = 0;
+    for (size_t i = 0; i < RANGE_INDEX_B; ++i) {
+        rank += node->starts[i] <= value;
     }
-    printf("Part 1: %lu\n", count);
+    return rank;
 }
 
-void part2(const struct ingredients* const ing)
+static inline bool range_index_check(const struct range_index* ri, size_t candidate, uint64_t value)
 {
-    size_t count = 0;
-    for (size_t i = 0; i < ing->num_fresh_ranges; ++i) {
-        count += ing->fresh_ranges[i].end - ing->fresh_ranges[i].start + 1;
+    // UINT64_MAX also matches the padding, so the only range it can be in is the last one
+    if (value == UINT64_MAX) {
+        return ri->num_ranges > 0 && ri->last_end == UINT64_MAX;
     }
-    printf("Part 2: %lu\n", count);
+    return candidate != SIZE_MAX && value <= ri->ends[candidate];
 }
 
-void parse_and_run(FILE* input_stream)
+RANGE_INDEX_SIMD bool range_index_contains(const struct range_index* ri, uint64_t value)
 {
-    struct ingredients* is = parse_ingredients(input_stream);
-    sort_ranges(is);
-    part1(is);
-    part2(is);
-
-    free_ingredients(is);
+    size_t candidate = SIZE_MAX;
+    size_t node = 0;
+    while (node < ri->num_nodes) {
+        size_t rank = range_index_rank(&ri->nodes[node], value);
+        if (rank > 0) {
+            candidate = node * RANGE_INDEX_B + rank - 1;
+        }
+        node = range_index_child(node, rank);
+    }
+    return range_index_check(ri, candidate, value);
 }
 
-int main()
+// Runs RANGE_INDEX_BATCH lookups in lockstep, one level at a time, prefetching every query's next node before any of
+// them is needed so the cache misses overlap. Returns how many IDs are fresh; `fresh` (optional) gets each answer.
+RANGE_INDEX_SIMD size_t range_index_contains_batch(
+    const struct range_index* ri, const uint64_t* ids, size_t n, bool* fresh)
 {
+    size_t count = 0;
+    size_t nodes[RANGE_INDEX_BATCH];
+    size_t candidates[RANGE_INDEX_BATCH];
+
+    for (size_t base = 0; base < n; base += RANGE_INDEX_BATCH) {
+        size_t group = n - base < RANGE_INDEX_BATCH ? n - base : RANGE_INDEX_BATCH;
+        for (size_t q = 0; q < group; ++q) {
+            nodes[q] = 0;
+            candidates[q] = SIZE_MAX;
+        }
+        for (size_t level = 0; level < ri->height; ++level) {
+            for (size_t q = 0; q < group; ++q) {
+                if (nodes[q] >= ri->num_nodes) {
+                    continue;
+                }
+                size_t rank = range_index_rank(&ri->nodes[nodes[q]], ids[base + q]);
+                if (rank > 0) {
+                    candidates[q] = nodes[q] * RANGE_INDEX_B + rank - 1;
+                }
+                nodes[q] = range_index_child(nodes[q], rank);
+                if (nodes[q] < ri->num_nodes) {
+                    __builtin_prefetch(&ri->nodes[nodes[q]]);
+                }
+            }
+        }
+        for (size_t q = 0; q < group; ++q) {
+            bool contained = range_index_check(ri, candidates[q], ids[base + q]);
+            count += contained;
+            if (fresh) {
+                fresh[base + q] = contained;
+            }
+        }
+    }
+    return count;
+}
+
+// Disjoint, non-adjacent fresh ranges in a treap keyed by start, for when ranges keep arriving. Each node carries the
+// covered length of its subtree, so the part 2 answer is the root's sum. Inserting merges with everything it
+// overlaps or touches; removing takes those IDs out of the set, splitting a range that straddles either end. Both are
+// a couple of splits and merges, O(log n) expected.
+struct interval_node {
+    uint64_t start;
+    uint64_t end;
+    uint64_t covered;
+    uint32_t priority;
+    struct interval_node* left;
+    struct interval_node* right;
+};
+
+struct interval_set {
+    struct interval_node* root;
+    size_t num_ranges;
+    uint32_t rng_state;
+};
+
+static void free_interval_nodes(struct interval_node* n)
+{
+    if (n) {
+        free_interval_nodes(n->left);
+        free_interval_nodes(n->right);
+        free(n);
+    }
+}
+
+void free_interval_set(struct interval_set* set)
+{
+    if (set) {
+        free_interval_nodes(set->root);
+        free(set);
+    }
+}
+
+struct interval_set* new_interval_set(void)
+{
+    struct interval_set* set = malloc(sizeof(struct interval_set));
+    *set = (struct interval_set) { .root = NULL, .num_ranges = 0, .rng_state = 0x9e3779b9u };
+    return set;
+}
+
+static uint64_t interval_covered(const struct interval_node* n) { return n ? n->covered : 0; }
+
+static void interval_update(struct interval_node* n)
+{
+    n->covered = n->end - n->start + 1 + interval_covered(n->left) + interval_covered(n->right);
+}
+
+static struct interval_node* interval_set_new_node(struct interval_set* set, uint64_t start, uint64_t end)
+{
+    // xorshift32, only needs to be unpredictable relative to the input order
+    uint32_t x = set->rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    set->rng_state = x;
+
+    struct interval_node* n = malloc(sizeof(struct interval_node));
+    *n = (struct interval_node) { .start = start, .end = end, .priority = x };
+    interval_update(n);
+    ++set->num_ranges;
+    return n;
+}
+
+// Splits into the nodes with start < key and the rest.
+static void interval_split(struct interval_node* n, uint64_t key, struct interval_node** lo, struct interval_node** hi)
+{
+    if (!n) {
+        *lo = NULL;
+        *hi = NULL;
+    } else if (n->start < key) {
+        interval_split(n->right, key, &n->right, hi);
+        interval_update(n);
+        *lo = n;
+    } else {
+        interval_split(n->left, key, lo, &n->left);
+        interval_update(n);
+        *hi = n;
+    }
+}
+
+// Every start in `lo` must be below every start in `hi`.
+static struct interval_node* interval_merge(struct interval_node* lo, struct interval_node* hi)
+{
+    if (!lo) {
+        return hi;
+    }
+    if (!hi) {
+        return lo;
+    }
+    if (lo->priority > hi->priority) {
+        lo->right = interval_merge(lo->right, hi);
+        interval_update(lo);
+        return lo;
+    }
+    hi->left = interval_merge(lo, hi->left);
+    interval_update(hi);
+    return hi;
+}
+
+static struct interval_node* interval_pop_max(struct interval_node** n)
+{
+    if ((*n)->right) {
+        struct interval_node* max = interval_pop_max(&(*n)->right);
+        interval_update(*n);
+        return max;
+    }
+    struct interval_node* max = *n;
+    *n = max->left;
+    max->left = NULL;
+    return max;
+}
+
+static const struct interval_node* interval_max(const struct interval_node* n)
+{
+    while (n && n->right) {
+        n = n->right;
+    }
+    return n;
+}
+
+static void interval_set_drop(struct interval_set* set, struct interval_node* n)
+{
+    if (n) {
+        interval_set_drop(set, n->left);
+        interval_set_drop(set, n->right);
+        free(n);
+        --set->num_ranges;
+    }
+}
+
+void interval_set_insert(struct interval_set* set, uint64_t start, uint64_t end)
+{
+    struct interval_node* lo;
+    struct interval_node* rest;
+    interval_split(set->root, start, &lo, &rest);
+
+    // The range just below may overlap or touch the new one.
+    const struct interval_node* below = interval_max(lo);
+    if (below && (below->end >= start - 1)) {
+        struct interval_node* n = interval_pop_max(&lo);
+        start = n->start;
+        end = n->end > end ? n->end : end;
+        free(n);
+        --set->num_ranges;
+    }
+
+    // Everything starting at or before end + 1 is swallowed; the last of those decides the merged end.
+    struct interval_node* swallowed = rest;
+    struct interval_node* hi = NULL;
+    if (end < UINT64_MAX - 1) {
+        interval_split(rest, end + 2, &swallowed, &hi);
+    }
+    const struct interval_node* last = interval_max(swallowed);
+    if (last && last->end > end) {
+        end = last->end;
+    }
+    interval_set_drop(set, swallowed);
+
+    set->root = interval_merge(interval_merge(lo, interval_set_new_node(set, start, end)), hi);
+}
+
+void interval_set_remove(struct interval_set* set, uint64_t start, uint64_t end)
+{
+    struct interval_node* lo;
+    struct interval_node* rest;
+    interval_split(set->root, start, &lo, &rest);
+
+    struct interval_node* left_piece = NULL;
+    struct interval_node* right_piece = NULL;
+    const struct interval_node* below = interval_max(lo);
+    if (below && below->end >= start) {
+        struct interval_node* n = interval_pop_max(&lo);
+        if (n->end > end) {
+            right_piece = interval_set_new_node(set, end + 1, n->end);
+        }
+        n->end = start - 1;
+        interval_update(n);
+        left_piece = n;
+    }
+
+    struct interval_node* removed = rest;
+    struct interval_node* hi = NULL;
+    if (end != UINT64_MAX) {
+        interval_split(rest, end + 1, &removed, &hi);
+    }
+    const struct interval_node* last = interval_max(removed);
+    if (last && last->end > end) {
+        right_piece = interval_set_new_node(set, end + 1, last->end);
+    }
+    interval_set_drop(set, removed);
+
+    set->root = interval_merge(interval_merge(interval_merge(lo, left_piece), right_piece), hi);
+}
+
+bool interval_set_contains(const struct interval_set* set, uint64_t value)
+{
+    const struct interval_node* n = set->root;
+    const struct interval_node* candidate = NULL;
+    while (n) {
+        if (n->start <= value) {
+            candidate = n;
+            n = n->right;
+        } else {
+            n = n->left;
+        }
+    }
+    return candidate && value <= candidate->end;
+}
+
+uint64_t interval_set_covered(const struct interval_set* set) { return interval_covered(set->root); }
+
+// Splits a query list across threads. The merged ranges are only read, so the workers share `ing` without locking;
+// each keeps its own count, and chunks start on multiples of 64 so no two workers write the same word of the optional
+// result bitmap (bit i of fresh_bits[i / 64] is set when ids[i] is fresh).
+#define PARALLEL_QUERY_MIN (1u << 20)
+
+struct query_chunk {
+    const struct ingredients* ing;
+    const uint64_t* ids;
+    size_t begin;
+    size_t end;
+    uint64_t* fresh_bits;
+    size_t count;
+};
+
+static void* query_chunk_run(void* arg)
+{
+    struct query_chunk* chunk = (struct query_chunk*)arg;
+    size_t count = 0;
+    for (size_t i = chunk->begin; i < chunk->end; ++i) {
+        bool contained = contained_in_range(chunk->ing, chunk->ids[i]);
+        count += contained;
+        if (chunk->fresh_bits && contained) {
+            chunk->fresh_bits[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+    }
+    chunk->count = count;
+    return NULL;
+}
+
+size_t online_cpu_count(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+// `fresh_bits`, if non-null, must hold (n + 63) / 64 words; it is cleared first.
+size_t contained_parallel(
+    const struct ingredients* ing, const uint64_t* ids, size_t n, size_t num_threads, uint64_t* fresh_bits)
+{
+    if (fresh_bits) {
+        memset(fresh_bits, 0, (n + 63) / 64 * sizeof(uint64_t));
+    }
+    if (num_threads == 0) {
+        num_threads = 1;
+    }
+
+    size_t words = (n + 63) / 64;
+    size_t words_per_thread = (words + num_threads - 1) / num_threads;
+    struct query_chunk* chunks = calloc(num_threads, sizeof(struct query_chunk));
+    pthread_t* threads = calloc(num_threads, sizeof(pthread_t));
+
+    for (size_t t = 0; t < num_threads; ++t) {
+        size_t begin = t * words_per_thread * 64;
+        size_t end = begin + words_per_thread * 64;
+        chunks[t] = (struct query_chunk) {
+            .ing = ing,
+            .ids = ids,
+            .begin = begin < n ? begin : n,
+            .end = end < n ? end : n,
+            .fresh_bits = fresh_bits,
+        };
+        // The calling thread takes the first chunk itself.
+        if (t > 0 && pthread_create(&threads[t], NULL, &query_chunk_run, &chunks[t]) != 0) {
+            perror("Failed to start query thread");
+            abort();
+        }
+    }
+    query_chunk_run(&chunks[0]);
+
+    size_t count = chunks[0].count;
+    for (size_t t = 1; t < num_threads; ++t) {
+        pthread_join(threads[t], NULL);
+        count += chunks[t].count;
+    }
+
+    free(threads);
+    free(chunks);
+    return count;
+}
+
+// Counts of fresh IDs inside arbitrary intervals. prefix[i] is how many IDs the first i merged ranges cover, so the
+// count up to x needs one search for the last range starting at or before x.
+struct range_counts {
+    size_t num_ranges;
+    const struct range* ranges;
+    uint64_t* prefix;
+};
+
+void free_range_counts(struct range_counts* rc)
+{
+    if (rc) {
+        free(rc->prefix);
+        free(rc);
+    }
+}
+
+// Borrows the ranges, which must have been through sort_ranges and must outlive the result.
+struct range_counts* new_range_counts(const struct ingredients* ing)
+{
+    struct range_counts* rc = malloc(sizeof(struct range_counts));
+    rc->num_ranges = ing->num_fresh_ranges;
+    rc->ranges = ing->fresh_ranges;
+    rc->prefix = malloc((ing->num_fresh_ranges + 1) * sizeof(uint64_t));
+    rc->prefix[0] = 0;
+    for (size_t i = 0; i < ing->num_fresh_ranges; ++i) {
+        rc->prefix[i + 1] = rc->prefix[i] + (ing->fresh_ranges[i].end - ing->fresh_ranges[i].start + 1);
+    }
+    return rc;
+}
+
+// Number of ranges whose start is <= x.
+static size_t range_counts_rank(const struct range_counts* rc, uint64_t x)
+{
+    size_t l = 0;
+    size_t u = rc->num_ranges;
+    while (l < u) {
+        size_t mid = (l + u) / 2;
+        if (rc->ranges[mid].start <= x) {
+            l = mid + 1;
+        } else {
+            u = mid;
+        }
+    }
+    return l;
+}
+
+// Fresh IDs <= x, given the rank of x.
+static uint64_t range_counts_upto(const struct range_counts* rc, size_t rank, uint64_t x)
+{
+    if (rank == 0) {
+        return 0;
+    }
+    const struct range* r = &rc->ranges[rank - 1];
+    uint64_t last = x < r->end ? x : r->end;
+    return rc->prefix[rank - 1] + (last - r->start + 1);
+}
+
+uint64_t range_counts_query(const struct range_counts* rc, uint64_t start, uint64_t end)
+{
+    if (end < start) {
+        return 0;
+    }
+    uint64_t upto_end = range_counts_upto(rc, range_counts_rank(rc, end), end);
+    if (start == 0) {
+        return upto_end;
+    }
+    return upto_end - range_counts_upto(rc, range_counts_rank(rc, start - 1), start - 1);
+}
+
+// Answers a list of query intervals sorted by start in one pass: the rank of each start comes from a cursor that
+// only moves forward. Ends usually move forward too and reuse a second cursor; an end that goes backwards falls back
+// to a search. counts[i] gets the number of fresh IDs in queries[i].
+void range_counts_query_sorted(const struct range_counts* rc, const struct range* queries, size_t n, uint64_t* counts)
+{
+    size_t start_rank = 0;
+    size_t end_rank = 0;
+    uint64_t previous_end = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t start = queries[i].start;
+        uint64_t end = queries[i].end;
+        if (end < start) {
+            counts[i] = 0;
+            continue;
+        }
+
+        if (end < previous_end) {
+            end_rank = range_counts_rank(rc, end);
+        }
+        while (end_rank < rc->num_ranges && rc->ranges[end_rank].start <= end) {
+            ++end_rank;
+        }
+        previous_end = end;
+        uint64_t upto_end = range_counts_upto(rc, end_rank, end);
+
+        if (start == 0) {
+            counts[i] = upto_end;
+            continue;
+        }
+        while (start_rank < rc->num_ranges && rc->ranges[start_rank].start <= start - 1) {
+            ++start_rank;
+        }
+        counts[i] = upto_end - range_counts_upto(rc, start_rank, start - 1);
+    }
+}
+
+void print_ingredients(const struct ingredients* ing)
+{
+    if (ing->packed) {
+        printf("Fresh IDs: %lu (packed, %zu ranges)\n", packed_ranges_covered(ing->packed), ing->packed->num_ranges);
+    }
+    if (ing->roaring) {
+        printf("Fresh IDs: %lu (roaring bitmap)\n", ing->roaring->cardinality);
+    }
+    printf("Fresh Ranges: %lu\n", ing->num_fresh_ranges);
+    for (size_t i = 0; i < ing->num_fresh_ranges; ++i) {
+        printf("  %lu-%lu\n", ing->fresh_ranges[i].start, ing->fresh_ranges[i].end);
+    }
+
+    printf("Required Ingredients:\n");
+    for (size_t i = 0; i < ing->num_required; ++i) {
+        printf("  %lu\n", ing->required[i]);
+    }
+}
+
+static inline uint64_t range_start_key(const struct range* r) { return r->start; }
+
+DEFINE_RADIX_SORT(range, struct range, range_start_key)
+
+// Sorts the ranges by start, then merges overlapping and touching ranges in place in one forward pass. The radix
+// scratch buffer is the only allocation.
+void sort_ranges(struct ingredients* ing)
+{
+    if (ing->num_fresh_ranges < 2) {
+        return;
+    }
+
+    struct range* scratch = malloc(sizeof(struct range) * ing->num_fresh_ranges);
+    range_radix_sort(ing->fresh_ranges, scratch, ing->num_fresh_ranges);
+    free(scratch);
+
+    struct range* ranges = ing->fresh_ranges;
+    size_t merged_count = 1;
+    for (size_t i = 1; i < ing->num_fresh_ranges; ++i) {
+        struct range* last = &ranges[merged_count - 1];
+        if (ranges[i].start <= last->end || ranges[i].start - 1 == last->end) {
+            if (ranges[i].end > last->end) {
+                last->end = ranges[i].end;
+            }
+        } else {
+            ranges[merged_count] = ranges[i];
+            ++merged_count;
+        }
+    }
+
+    ing->num_fresh_ranges = merged_count;
+}
+
+// Below this many merged ranges the plain array stays in cache and the sweep in contained_batch beats decoding blocks.
+#define PACKED_MIN_RANGES ((size_t)1 << 20)
+
+// Keeps only the smallest form of the merged ranges: the ranges themselves, the packed blocks once there are at least
+// PACKED_MIN_RANGES of them, or the roaring bitmap. Call after sort_ranges. Structures built from the intervals
+// (range_index, range_counts, snapshot_index) have to be built before this is called.
+void select_fresh_backend(struct ingredients* ing)
+{
+    if (ing->packed || ing->roaring) {
+        return;
+    }
+    size_t best_bytes = ing->num_fresh_ranges * sizeof(struct range);
+    size_t roaring_bytes = roaring_walk(ing, NULL);
+    struct packed_ranges* packed = NULL;
+    if (ing->num_fresh_ranges >= PACKED_MIN_RANGES) {
+        packed = new_packed_ranges(ing);
+        if (packed_ranges_bytes(packed) < best_bytes && packed_ranges_bytes(packed) <= roaring_bytes) {
+            ing->packed = packed;
+            best_bytes = packed_ranges_bytes(packed);
+        } else {
+            free_packed_ranges(packed);
+        }
+    }
+    if (!ing->packed && roaring_bytes < best_bytes) {
+        ing->roaring = new_roaring_set(ing);
+    }
+    if (ing->packed || ing->roaring) {
+        free(ing->fresh_ranges);
+        ing->fresh_ranges = NULL;
+        ing->num_fresh_ranges = 0;
+    }
+}
+
+void free_ingredients(struct ingredients* ing)
+{
+    if (ing) {
+        free(ing->fresh_ranges);
+        free(ing->required);
+        free_packed_ranges(ing->packed);
+        free_roaring_set(ing->roaring);
+        free(ing);
+    }
+}
+
+// Reads the range block up to the blank line that separates it from the IDs. The result has no required IDs.
+struct ingredients* parse_fresh_ranges(FILE* input_stream)
+{
+    struct range* ranges = NULL;
+    size_t ranges_count = 0;
+
+    char line_buffer[256];
+
+    while (true) {
+        uint64_t start, end;
+        char* line_buffer_ret = fgets(line_buffer, sizeof(line_buffer), input_stream);
+        if (!line_buffer_ret || line_buffer[0] == '\n') {
+            break;
+        }
+        int scanf_ret = sscanf(line_buffer_ret, "%lu-%lu", &start, &end);
+        if (scanf_ret != 2) {
+            break;
+        }
+
+        ranges = realloc(ranges, sizeof(struct range) * (ranges_count + 1));
+        ranges[ranges_count] = (struct range) { .start = start, .end = end };
+        ++ranges_count;
+    }
+
+    struct ingredients* result = malloc(sizeof(struct ingredients));
+    *result = (struct ingredients) {
+        .fresh_ranges = ranges,
+        .required = NULL,
+        .num_fresh_ranges = ranges_count,
+        .num_required = 0,
+    };
+    return result;
+}
+
+struct ingredients* parse_ingredients(FILE* input_stream)
+{
+    struct ingredients* result = parse_fresh_ranges(input_stream);
+    char line_buffer[256];
+
+    uint64_t* required_list = NULL;
+    size_t required_count = 0;
+    while (true) {
+        uint64_t required;
+        char* line_buffer_ret = fgets(line_buffer, sizeof(line_buffer), input_stream);
+        if (!line_buffer_ret || line_buffer[0] == '\n') {
+            break;
+        }
+
+        int scanf_ret = sscanf(line_buffer_ret, "%lu", &required);
+
+        if (scanf_ret != 1) {
+            break;
+        }
+
+        required_list = realloc(required_list, sizeof(uint64_t) * (required_count + 1));
+        required_list[required_count] = required;
+        ++required_count;
+    }
+
+    result->required = required_list;
+    result->num_required = required_count;
+    return result;
+}
+
+enum stream_output {
+    STREAM_OUTPUT_NONE,
+    STREAM_OUTPUT_PER_ID,
+    STREAM_OUTPUT_RUNNING_COUNT,
+};
+
+// Answers IDs one line at a time as they arrive on `input_stream`, against ranges that have been through sort_ranges.
+// Nothing is kept per ID, so memory stays constant however long the stream runs. Each answer ("<id> fresh" or
+// "<id> spoiled", or the running count of fresh IDs) is flushed as soon as its line is read. Blank lines are
+// skipped; the stream ends at EOF or at a line that is not a number. Returns the number of fresh IDs seen.
+size_t stream_queries(const struct ingredients* ing, FILE* input_stream, FILE* output, enum stream_output mode)
+{
+    char line_buffer[256];
+    size_t count = 0;
+    while (fgets(line_buffer, sizeof(line_buffer), input_stream)) {
+        if (line_buffer[0] == '\n') {
+            continue;
+        }
+        uint64_t id;
+        if (sscanf(line_buffer, "%lu", &id) != 1) {
+            break;
+        }
+
+        bool fresh = contained_in_range(ing, id);
+        count += fresh;
+        if (mode == STREAM_OUTPUT_PER_ID) {
+            fprintf(output, "%lu %s\n", id, fresh ? "fresh" : "spoiled");
+            fflush(output);
+        } else if (mode == STREAM_OUTPUT_RUNNING_COUNT) {
+            fprintf(output, "%zu\n", count);
+            fflush(output);
+        }
+    }
+    return count;
+}
+
+void stream_and_run(FILE* input_stream, enum stream_output mode)
+{
+    struct ingredients* ing = parse_fresh_ranges(input_stream);
+    sort_ranges(ing);
+    select_fresh_backend(ing);
+    size_t count = stream_queries(ing, input_stream, stdout, mode);
+    if (mode == STREAM_OUTPUT_NONE) {
+        printf("Part 1 (streaming): %zu\n", count);
+    }
+    free_ingredients(ing);
+}
+
+// Fresh ranges that keep taking updates while other threads look IDs up. Each published version is an immutable,
+// merged `struct ingredients`; readers pick up the current one with a single atomic load and never take a lock.
+// Updates are queued, and a writer builds the next version off to the side and swaps it in atomically.
+//
+// Old versions are reclaimed by epoch: a reader announces the global epoch before loading the current version and
+// clears it when done, and a replaced version is tagged with the epoch in which it was replaced. It can be freed once
+// every active reader announced a later epoch, since those readers loaded the version that replaced it.
+#define MAX_SNAPSHOT_READERS 64
+
+struct range_snapshot {
+    struct ingredients* ing;
+    uint64_t version;
+    uint64_t retired_epoch;
+    struct range_snapshot* next_retired;
+};
+
+struct snapshot_reader {
+    _Atomic uint64_t epoch;
+    atomic_bool in_use;
+};
+
+struct snapshot_index {
+    _Atomic(struct range_snapshot*) current;
+    _Atomic uint64_t epoch;
+    struct snapshot_reader readers[MAX_SNAPSHOT_READERS];
+
+    // The update queue and writer thread state, under `lock`
+    pthread_mutex_t lock;
+    pthread_cond_t pending_cond;
+    struct range* pending;
+    size_t num_pending;
+    size_t pending_capacity;
+    pthread_t writer;
+    bool writer_running;
+    bool stop_writer;
+
+    // Held by a publisher for the whole read-merge-swap-retire sequence, so publishers never build from the same
+    // base version. Also guards the retired list.
+    pthread_mutex_t publish_lock;
+    struct range_snapshot* retired;
+};
+
+static struct range_snapshot* new_range_snapshot(struct ingredients* ing, uint64_t version)
+{
+    struct range_snapshot* snap = malloc(sizeof(struct range_snapshot));
+    *snap = (struct range_snapshot) { .ing = ing, .version = version };
+    return snap;
+}
+
+// Takes ownership of `ing`, whose ranges need not be sorted yet.
+struct snapshot_index* new_snapshot_index(struct ingredients* ing)
+{
+    struct snapshot_index* idx = calloc(1, sizeof(struct snapshot_index));
+    sort_ranges(ing);
+    atomic_init(&idx->current, new_range_snapshot(ing, 0));
+    atomic_init(&idx->epoch, 1);
+    for (size_t i = 0; i < MAX_SNAPSHOT_READERS; ++i) {
+        atomic_init(&idx->readers[i].epoch, 0);
+        atomic_init(&idx->readers[i].in_use, false);
+    }
+    pthread_mutex_init(&idx->lock, NULL);
+    pthread_mutex_init(&idx->publish_lock, NULL);
+    pthread_cond_init(&idx->pending_cond, NULL);
+    return idx;
+}
+
+struct snapshot_reader* snapshot_index_register_reader(struct snapshot_index* idx)
+{
+    for (size_t i = 0; i < MAX_SNAPSHOT_READERS; ++i) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&idx->readers[i].in_use, &expected, true)) {
+            return &idx->readers[i];
+        }
+    }
+    fprintf(stderr, "More than %d snapshot readers\n", MAX_SNAPSHOT_READERS);
+    abort();
+}
+
+void snapshot_index_unregister_reader(struct snapshot_reader* reader)
+{
+    atomic_store(&reader->epoch, 0);
+    atomic_store(&reader->in_use, false);
+}
+
+// The returned version stays valid until snapshot_read_end on the same reader.
+const struct ingredients* snapshot_read_begin(struct snapshot_index* idx, struct snapshot_reader* reader)
+{
+    atomic_store(&reader->epoch, atomic_load(&idx->epoch));
+    return atomic_load(&idx->current)->ing;
+}
+
+void snapshot_read_end(struct snapshot_reader* reader) { atomic_store(&reader->epoch, 0); }
+
+bool snapshot_index_contains(struct snapshot_index* idx, struct snapshot_reader* reader, uint64_t value)
+{
+    bool contained = contained_in_range(snapshot_read_begin(idx, reader), value);
+    snapshot_read_end(reader);
+    return contained;
+}
+
+void snapshot_index_add_range(struct snapshot_index* idx, uint64_t start, uint64_t end)
+{
+    pthread_mutex_lock(&idx->lock);
+    if (idx->num_pending >= idx->pending_capacity) {
+        idx->pending_capacity = idx->pending_capacity ? idx->pending_capacity * 2 : 64;
+        idx->pending = realloc(idx->pending, idx->pending_capacity * sizeof(struct range));
+    }
+    idx->pending[idx->num_pending++] = (struct range) { .start = start, .end = end };
+    pthread_cond_signal(&idx->pending_cond);
+    pthread_mutex_unlock(&idx->lock);
+}
+
+// Frees the retired versions that no active reader can still hold. Call with the publish lock held.
+static void snapshot_index_reclaim(struct snapshot_index* idx)
+{
+    uint64_t oldest_reader = UINT64_MAX;
+    for (size_t i = 0; i < MAX_SNAPSHOT_READERS; ++i) {
+        uint64_t e = atomic_load(&idx->readers[i].epoch);
+        if (e != 0 && e < oldest_reader) {
+            oldest_reader = e;
+        }
+    }
+
+    struct range_snapshot** link = &idx->retired;
+    while (*link) {
+        struct range_snapshot* snap = *link;
+        if (snap->retired_epoch < oldest_reader) {
+            *link = snap->next_retired;
+            free_ingredients(snap->ing);
+            free(snap);
+        } else {
+            link = &snap->next_retired;
+        }
+    }
+}
+
+// Merges the queued ranges into a new version and makes it current. Returns false if nothing was queued. Readers
+// keep running throughout and ranges can still be queued during the merge; only other publishers wait.
+bool snapshot_index_publish(struct snapshot_index* idx)
+{
+    pthread_mutex_lock(&idx->publish_lock);
+    pthread_mutex_lock(&idx->lock);
+    struct range* pending = idx->pending;
+    size_t num_pending = idx->num_pending;
+    idx->pending = NULL;
+    idx->num_pending = 0;
+    idx->pending_capacity = 0;
+    pthread_mutex_unlock(&idx->lock);
+    if (num_pending == 0) {
+        pthread_mutex_unlock(&idx->publish_lock);
+        return false;
+    }
+
+    // Only publishers replace `current`, and they all hold the publish lock
+    struct range_snapshot* old = atomic_load(&idx->current);
+
+    const struct ingredients* old_ing = old->ing;
+    size_t num_ranges = old_ing->num_fresh_ranges + num_pending;
+    struct ingredients* next = calloc(1, sizeof(struct ingredients));
+    next->fresh_ranges = malloc(num_ranges * sizeof(struct range));
+    next->num_fresh_ranges = num_ranges;
+    if (old_ing->num_fresh_ranges > 0) {
+        memcpy(next->fresh_ranges, old_ing->fresh_ranges, old_ing->num_fresh_ranges * sizeof(struct range));
+    }
+    memcpy(&next->fresh_ranges[old_ing->num_fresh_ranges], pending, num_pending * sizeof(struct range));
+    free(pending);
+    // Versions stay in interval form, since the next publish merges from them
+    sort_ranges(next);
+
+    atomic_store(&idx->current, new_range_snapshot(next, old->version + 1));
+    old->retired_epoch = atomic_fetch_add(&idx->epoch, 1);
+    old->next_retired = idx->retired;
+    idx->retired = old;
+    snapshot_index_reclaim(idx);
+    pthread_mutex_unlock(&idx->publish_lock);
+    return true;
+}
+
+static void* snapshot_writer_run(void* arg)
+{
+    struct snapshot_index* idx = (struct snapshot_index*)arg;
+    pthread_mutex_lock(&idx->lock);
+    while (true) {
+        while (idx->num_pending == 0 && !idx->stop_writer) {
+            pthread_cond_wait(&idx->pending_cond, &idx->lock);
+        }
+        if (idx->num_pending == 0) {
+            break;
+        }
+        pthread_mutex_unlock(&idx->lock);
+        snapshot_index_publish(idx);
+        pthread_mutex_lock(&idx->lock);
+    }
+    pthread_mutex_unlock(&idx->lock);
+    return NULL;
+}
+
+// Starts a background thread that publishes a new version whenever ranges are queued.
+void snapshot_index_start_writer(struct snapshot_index* idx)
+{
+    idx->stop_writer = false;
+    if (pthread_create(&idx->writer, NULL, &snapshot_writer_run, idx) != 0) {
+        perror("Failed to start snapshot writer");
+        abort();
+    }
+    idx->writer_running = true;
+}
+
+// Publishes whatever is still queued, then stops the background writer.
+void snapshot_index_stop_writer(struct snapshot_index* idx)
+{
+    if (!idx->writer_running) {
+        return;
+    }
+    pthread_mutex_lock(&idx->lock);
+    idx->stop_writer = true;
+    pthread_cond_signal(&idx->pending_cond);
+    pthread_mutex_unlock(&idx->lock);
+    pthread_join(idx->writer, NULL);
+    idx->writer_running = false;
+}
+
+// All readers must be done with the index.
+void free_snapshot_index(struct snapshot_index* idx)
+{
+    if (!idx) {
+        return;
+    }
+    snapshot_index_stop_writer(idx);
+    for (struct range_snapshot* snap = idx->retired; snap;) {
+        struct range_snapshot* next = snap->next_retired;
+        free_ingredients(snap->ing);
+        free(snap);
+        snap = next;
+    }
+    struct range_snapshot* current = atomic_load(&idx->current);
+    free_ingredients(current->ing);
+    free(current);
+    free(idx->pending);
+    pthread_mutex_destroy(&idx->lock);
+    pthread_mutex_destroy(&idx->publish_lock);
+    pthread_cond_destroy(&idx->pending_cond);
+    free(idx);
+}
+
+// Self-checks and benchmarks. Besides the input's own ranges they run on synthetic ones, which are sorted and
+// disjoint as sort_ranges would leave them.
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// splitmix64
+static uint64_t next_random(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// num_ranges merged ranges with lengths of 1 to max_length + 1 and gaps of 1 to max_gap + 1 IDs between them, and
+// num_ids required IDs spread over the same span and a little past it.
+struct ingredients* random_ingredients(
+    size_t num_ranges, size_t num_ids, uint64_t max_gap, uint64_t max_length, uint64_t seed)
+{
+    uint64_t state = seed;
+    struct ingredients* ing = calloc(1, sizeof(struct ingredients));
+    ing->fresh_ranges = malloc((num_ranges + 1) * sizeof(struct range));
+    ing->required = malloc((num_ids + 1) * sizeof(uint64_t));
+    uint64_t next_start = next_random(&state) % (max_gap + 1);
+    for (size_t i = 0; i < num_ranges; ++i) {
+        uint64_t start = next_start;
+        uint64_t end = start + next_random(&state) % (max_length + 1);
+        ing->fresh_ranges[i] = (struct range) { .start = start, .end = end };
+        next_start = end + 2 + next_random(&state) % (max_gap + 1);
+    }
+    for (size_t i = 0; i < num_ids; ++i) {
+        ing->required[i] = next_random(&state) % next_start;
+    }
+    ing->num_fresh_ranges = num_ranges;
+    ing->num_required = num_ids;
+    return ing;
+}
+
+// IDs worth asking about: both ends of every range and the IDs just outside them, the required IDs, and both ends
+// of the ID space. The caller frees the result.
+static uint64_t* probe_ids(const struct ingredients* ing, size_t* num_probes)
+{
+    uint64_t* probes = malloc((4 * ing->num_fresh_ranges + ing->num_required + 2) * sizeof(uint64_t));
+    size_t n = 0;
+    for (size_t i = 0; i < ing->num_fresh_ranges; ++i) {
+        probes[n++] = ing->fresh_ranges[i].start - 1;
+        probes[n++] = ing->fresh_ranges[i].start;
+        probes[n++] = ing->fresh_ranges[i].end;
+        probes[n++] = ing->fresh_ranges[i].end + 1;
+    }
+    memcpy(&probes[n], ing->required, ing->num_required * sizeof(uint64_t));
+    n += ing->num_required;
+    probes[n++] = 0;
+    probes[n++] = UINT64_MAX;
+    *num_probes = n;
+    return probes;
+}
+
+// The index must answer like the binary search, one ID at a time and in batches.
+bool check_range_index(const struct ingredients* ing)
+{
+    size_t num_probes;
+    uint64_t* probes = probe_ids(ing, &num_probes);
+    bool* fresh = malloc(num_probes * sizeof(bool));
+    struct range_index* ri = new_range_index(ing);
+
+    size_t count = range_index_contains_batch(ri, probes, num_probes, fresh);
+    size_t expected_count = 0;
+    bool ok = true;
+    for (size_t i = 0; i < num_probes; ++i) {
+        bool expected = contained_in_range(ing, probes[i]);
+        expected_count += expected;
+        ok &= fresh[i] == expected && range_index_contains(ri, probes[i]) == expected;
+    }
+    ok &= count == expected_count;
+
+    free_range_index(ri);
+    free(fresh);
+    free(probes);
+    return ok;
+}
+
+#define INTERVAL_CHECK_SPAN 512
+#define INTERVAL_CHECK_STEPS 2000
+
+// Inserting the ranges out of order must give back the same ranges. Then random inserts and removes, once at the
+// bottom of the ID space and once at the top, must match a plain bitmap after every step.
+bool check_interval_set(const struct ingredients* ing)
+{
+    struct interval_set* set = new_interval_set();
+    uint64_t covered = 0;
+    for (size_t i = ing->num_fresh_ranges; i > 0; --i) {
+        interval_set_insert(set, ing->fresh_ranges[i - 1].start, ing->fresh_ranges[i - 1].end);
+        covered += ing->fresh_ranges[i - 1].end - ing->fresh_ranges[i - 1].start + 1;
+    }
+    bool ok = interval_set_covered(set) == covered && set->num_ranges == ing->num_fresh_ranges;
+    size_t num_probes;
+    uint64_t* probes = probe_ids(ing, &num_probes);
+    for (size_t i = 0; i < num_probes; ++i) {
+        ok &= interval_set_contains(set, probes[i]) == contained_in_range(ing, probes[i]);
+    }
+    free(probes);
+    free_interval_set(set);
+
+    bool cells[INTERVAL_CHECK_SPAN];
+    uint64_t state = ing->num_fresh_ranges;
+    for (size_t trial = 0; trial < 2 && ok; ++trial) {
+        uint64_t base = trial == 0 ? 0 : UINT64_MAX - (INTERVAL_CHECK_SPAN - 1);
+        memset(cells, 0, sizeof(cells));
+        set = new_interval_set();
+        for (size_t step = 0; step < INTERVAL_CHECK_STEPS && ok; ++step) {
+            size_t first = next_random(&state) % INTERVAL_CHECK_SPAN;
+            size_t last = first + next_random(&state) % 32;
+            last = last < INTERVAL_CHECK_SPAN ? last : INTERVAL_CHECK_SPAN - 1;
+            bool insert = next_random(&state) % 3 != 0;
+            if (insert) {
+                interval_set_insert(set, base + first, base + last);
+            } else {
+                interval_set_remove(set, base + first, base + last);
+            }
+            for (size_t x = first; x <= last; ++x) {
+                cells[x] = insert;
+            }
+
+            uint64_t expected_covered = 0;
+            size_t expected_ranges = 0;
+            for (size_t x = 0; x < INTERVAL_CHECK_SPAN; ++x) {
+                expected_covered += cells[x];
+                expected_ranges += cells[x] && (x == 0 || !cells[x - 1]);
+                ok &= interval_set_contains(set, base + x) == cells[x];
+            }
+            ok &= interval_set_covered(set) == expected_covered && set->num_ranges == expected_ranges;
+        }
+        free_interval_set(set);
+    }
+    return ok;
+}
+
+// The packed form must give the same part 2 answer and the same lookups as the ranges it was built from.
+bool check_packed_ranges(const struct ingredients* ing)
+{
+    struct packed_ranges* pr = new_packed_ranges(ing);
+    uint64_t covered = 0;
+    for (size_t i = 0; i < ing->num_fresh_ranges; ++i) {
+        covered += ing->fresh_ranges[i].end - ing->fresh_ranges[i].start + 1;
+    }
+    bool ok = packed_ranges_covered(pr) == covered;
+    size_t num_probes;
+    uint64_t* probes = probe_ids(ing, &num_probes);
+    for (size_t i = 0; i < num_probes; ++i) {
+        ok &= packed_ranges_contains(pr, probes[i]) == contained_in_range(ing, probes[i]);
+    }
+    free(probes);
+    free_packed_ranges(pr);
+    return ok;
+}
+
+#define RANGE_COUNT_CHECK_QUERIES 512
+
+static uint64_t overlap_count(const struct ingredients* ing, uint64_t start, uint64_t end)
+{
+    uint64_t count = 0;
+    for (size_t i = 0; i < ing->num_fresh_ranges; ++i) {
+        uint64_t lo = start > ing->fresh_ranges[i].start ? start : ing->fresh_ranges[i].start;
+        uint64_t hi = end < ing->fresh_ranges[i].end ? end : ing->fresh_ranges[i].end;
+        count += lo <= hi ? hi - lo + 1 : 0;
+    }
+    return count;
+}
+
+// Intervals between random probe IDs, some of them empty, answered one at a time and as a sorted batch, against
+// adding up each range's overlap with them.
+bool check_range_counts(const struct ingredients* ing)
+{
+    size_t num_probes;
+    uint64_t* probes = probe_ids(ing, &num_probes);
+    struct range* queries = malloc(RANGE_COUNT_CHECK_QUERIES * sizeof(struct range));
+    struct range* scratch = malloc(RANGE_COUNT_CHECK_QUERIES * sizeof(struct range));
+    uint64_t* counts = malloc(RANGE_COUNT_CHECK_QUERIES * sizeof(uint64_t));
+    uint64_t state = ing->num_fresh_ranges;
+    for (size_t q = 0; q < RANGE_COUNT_CHECK_QUERIES; ++q) {
+        uint64_t a = probes[next_random(&state) % num_probes];
+        uint64_t b = probes[next_random(&state) % num_probes];
+        bool empty = q % 16 == 0;
+        queries[q] = (struct range) { .start = (a < b) != empty ? a : b, .end = (a < b) != empty ? b : a };
+    }
+    range_radix_sort(queries, scratch, RANGE_COUNT_CHECK_QUERIES);
+
+    struct range_counts* rc = new_range_counts(ing);
+    range_counts_query_sorted(rc, queries, RANGE_COUNT_CHECK_QUERIES, counts);
+    bool ok = true;
+    for (size_t q = 0; q < RANGE_COUNT_CHECK_QUERIES; ++q) {
+        uint64_t start = queries[q].start;
+        uint64_t end = queries[q].end;
+        uint64_t expected = end < start ? 0 : overlap_count(ing, start, end);
+        ok &= counts[q] == expected && range_counts_query(rc, start, end) == expected;
+    }
+
+    free_range_counts(rc);
+    free(counts);
+    free(scratch);
+    free(queries);
+    free(probes);
+    return ok;
+}
+
+#define SNAPSHOT_CHECK_READERS 2
+#define SNAPSHOT_CHECK_PUBLISHERS 2
+
+struct snapshot_check {
+    struct snapshot_index* idx;
+    const struct range* ranges;
+    size_t num_ranges;
+    const uint64_t* probes;
+    size_t num_probes;
+    atomic_bool done;
+    atomic_bool failed;
+};
+
+// Every version a reader sees must be sorted, disjoint and agree with a linear scan of its own ranges.
+static void* snapshot_check_read(void* arg)
+{
+    struct snapshot_check* check = (struct snapshot_check*)arg;
+    struct snapshot_reader* reader = snapshot_index_register_reader(check->idx);
+    while (!atomic_load(&check->done)) {
+        const struct ingredients* ing = snapshot_read_begin(check->idx, reader);
+        for (size_t i = 0; i < ing->num_fresh_ranges; ++i) {
+            if (i > 0 && ing->fresh_ranges[i - 1].end >= ing->fresh_ranges[i].start) {
+                atomic_store(&check->failed, true);
+            }
+        }
+        for (size_t p = 0; p < check->num_probes; ++p) {
+            uint64_t id = check->probes[p];
+            bool expected = false;
+            for (size_t i = 0; i < ing->num_fresh_ranges; ++i) {
+                expected |= ing->fresh_ranges[i].start <= id && id <= ing->fresh_ranges[i].end;
+            }
+            if (contained_in_range(ing, id) != expected) {
+                atomic_store(&check->failed, true);
+            }
+        }
+        snapshot_read_end(reader);
+    }
+    snapshot_index_unregister_reader(reader);
+    return NULL;
+}
+
+// Publishers race each other and the background writer, each queueing every range again.
+static void* snapshot_check_publish(void* arg)
+{
+    struct snapshot_check* check = (struct snapshot_check*)arg;
+    for (size_t i = 0; i < check->num_ranges; ++i) {
+        snapshot_index_add_range(check->idx, check->ranges[i].start, check->ranges[i].end);
+        snapshot_index_publish(check->idx);
+    }
+    return NULL;
+}
+
+// Rebuilds the fresh ranges of `ing` through a snapshot index under concurrent readers, publishers and the background
+// writer, then checks the final version answers like `ing` does. Every publish re-merges the whole set, so this is
+// quadratic in the number of ranges.
+bool snapshot_self_check(const struct ingredients* ing)
+{
+    struct ingredients* empty = calloc(1, sizeof(struct ingredients));
+    struct snapshot_check check = {
+        .idx = new_snapshot_index(empty),
+        .ranges = ing->fresh_ranges,
+        .num_ranges = ing->num_fresh_ranges,
+    };
+    uint64_t* probes = probe_ids(ing, &check.num_probes);
+    check.probes = probes;
+    atomic_init(&check.done, false);
+    atomic_init(&check.failed, false);
+
+    pthread_t readers[SNAPSHOT_CHECK_READERS];
+    pthread_t publishers[SNAPSHOT_CHECK_PUBLISHERS];
+    snapshot_index_start_writer(check.idx);
+    for (size_t t = 0; t < SNAPSHOT_CHECK_READERS; ++t) {
+        pthread_create(&readers[t], NULL, &snapshot_check_read, &check);
+    }
+    for (size_t t = 0; t < SNAPSHOT_CHECK_PUBLISHERS; ++t) {
+        pthread_create(&publishers[t], NULL, &snapshot_check_publish, &check);
+    }
+    for (size_t t = 0; t < SNAPSHOT_CHECK_PUBLISHERS; ++t) {
+        pthread_join(publishers[t], NULL);
+    }
+    snapshot_index_stop_writer(check.idx);
+    atomic_store(&check.done, true);
+    for (size_t t = 0; t < SNAPSHOT_CHECK_READERS; ++t) {
+        pthread_join(readers[t], NULL);
+    }
+
+    bool ok = !atomic_load(&check.failed);
+    struct snapshot_reader* reader = snapshot_index_register_reader(check.idx);
+    for (size_t p = 0; p < check.num_probes; ++p) {
+        ok &= snapshot_index_contains(check.idx, reader, probes[p]) == contained_in_range(ing, probes[p]);
+    }
+    snapshot_index_unregister_reader(reader);
+    free_snapshot_index(check.idx);
+    free(probes);
+    return ok;
+}
+
+// Checks every structure built from merged ranges against the ranges themselves, on `ing` and on two synthetic sets:
+// many short ranges, and fewer with gaps and lengths wider than 32 bits. `ing` must have been through sort_ranges but
+// not select_fresh_backend. The checks are meant for small inputs like the sample.
+bool self_check(const struct ingredients* ing)
+{
+    struct ingredients* narrow = random_ingredients(1000, 1000, 8, 8, 1);
+    struct ingredients* wide = random_ingredients(300, 300, (uint64_t)1 << 40, (uint64_t)1 << 36, 2);
+    const struct ingredients* const sets[] = { ing, narrow, wide };
+
+    bool index_ok = true;
+    bool interval_ok = true;
+    bool packed_ok = true;
+    bool counts_ok = true;
+    bool snapshot_ok = true;
+    for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); ++i) {
+        index_ok &= check_range_index(sets[i]);
+        interval_ok &= check_interval_set(sets[i]);
+        packed_ok &= check_packed_ranges(sets[i]);
+        counts_ok &= check_range_counts(sets[i]);
+        snapshot_ok &= snapshot_self_check(sets[i]);
+    }
+    printf("Self-check (range index): %s\n", index_ok ? "ok" : "FAILED");
+    printf("Self-check (interval set): %s\n", interval_ok ? "ok" : "FAILED");
+    printf("Self-check (packed ranges): %s\n", packed_ok ? "ok" : "FAILED");
+    printf("Self-check (range counts): %s\n", counts_ok ? "ok" : "FAILED");
+    printf("Self-check (snapshot index): %s\n", snapshot_ok ? "ok" : "FAILED");
+
+    free_ingredients(narrow);
+    free_ingredients(wide);
+    return index_ok && interval_ok && packed_ok && counts_ok && snapshot_ok;
+}
+
+#define BENCH_DEFAULT_RANGES 10000000
+
+static void bench_report(const char* name, uint64_t ns, size_t n, size_t fresh, uint64_t baseline_ns)
+{
+    ns = ns ? ns : 1;
+    printf("  %-20s %8.1f ns/ID %6.1fx  (%zu fresh)\n", name, (double)ns / (double)n, (double)baseline_ns / (double)ns,
+        fresh);
+}
+
+// Times each lookup path against the per-query upper_bound search, on num_ranges synthetic ranges and as many
+// random IDs.
+void bench_lookups(size_t num_ranges)
+{
+    struct ingredients* ing = random_ingredients(num_ranges, num_ranges, 1000, 100, 42);
+    const uint64_t* ids = ing->required;
+    size_t n = ing->num_required;
+    printf("Lookups of %zu IDs in %zu ranges:\n", n, num_ranges);
+
+    uint64_t start = now_ns();
+    size_t fresh = 0;
+    for (size_t i = 0; i < n; ++i) {
+        fresh += contained_in_range(ing, ids[i]);
+    }
+    uint64_t baseline_ns = now_ns() - start;
+    bench_report("upper_bound", baseline_ns, n, fresh, baseline_ns);
+
+    start = now_ns();
+    fresh = contained_batch(ing, ids, n, NULL);
+    bench_report("sort-merge batch", now_ns() - start, n, fresh, baseline_ns);
+
+    start = now_ns();
+    struct range_index* ri = new_range_index(ing);
+    uint64_t build_ns = now_ns() - start;
+    start = now_ns();
+    fresh = 0;
+    for (size_t i = 0; i < n; ++i) {
+        fresh += range_index_contains(ri, ids[i]);
+    }
+    bench_report("range_index", now_ns() - start, n, fresh, baseline_ns);
+    start = now_ns();
+    fresh = range_index_contains_batch(ri, ids, n, NULL);
+    bench_report("range_index batched", now_ns() - start, n, fresh, baseline_ns);
+    printf("  range_index built in %.1f ms\n", (double)build_ns / 1e6);
+    free_range_index(ri);
+
+    struct packed_ranges* pr = new_packed_ranges(ing);
+    start = now_ns();
+    fresh = 0;
+    for (size_t i = 0; i < n; ++i) {
+        fresh += packed_ranges_contains(pr, ids[i]);
+    }
+    bench_report("packed_ranges", now_ns() - start, n, fresh, baseline_ns);
+    printf("  packed_ranges take %zu bytes, the ranges %zu\n", packed_ranges_bytes(pr),
+        num_ranges * sizeof(struct range));
+    free_packed_ranges(pr);
+
+    free_ingredients(ing);
+}
+
+void part1(const struct ingredients* const ing)
+{
+    size_t count;
+    size_t cpus = online_cpu_count();
+    if (ing->num_required >= PARALLEL_QUERY_MIN && cpus > 1) {
+        count = contained_parallel(ing, ing->required, ing->num_required, cpus, NULL);
+    } else {
+        count = contained_batch(ing, ing->required, ing->num_required, NULL);
+    }
+    printf("Part 1: %lu\n", count);
+}
+
+void part2(const struct ingredients* const ing)
+{
+    size_t count = 0;
+    if (ing->packed) {
+        count = packed_ranges_covered(ing->packed);
+    }
+    if (ing->roaring) {
+        count = ing->roaring->cardinality;
+    }
+    for (size_t i = 0; i < ing->num_fresh_ranges; ++i) {
+        count += ing->fresh_ranges[i].end - ing->fresh_ranges[i].start + 1;
+    }
+    printf("Part 2: %lu\n", count);
+}
+
+// Returns false if `run_self_check` is set and a check failed.
+bool parse_and_run(FILE* input_stream, bool run_self_check)
+{
+    struct ingredients* is = parse_ingredients(input_stream);
+    sort_ranges(is);
+    // The checks compare against the merged intervals, so they run before the ranges may be swapped for another form
+    bool ok = !run_self_check || self_check(is);
+    select_fresh_backend(is);
+    part1(is);
+    part2(is);
+
+    free_ingredients(is);
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    // Ranges then an open-ended ID stream on stdin, answered as the IDs arrive
+    if (argc > 1 && strcmp(argv[1], "--stream") == 0) {
+        stream_and_run(stdin, STREAM_OUTPUT_PER_ID);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--stream-count") == 0) {
+        stream_and_run(stdin, STREAM_OUTPUT_RUNNING_COUNT);
+        return 0;
+    }
+    // Times the lookup paths on synthetic ranges, BENCH_DEFAULT_RANGES of them unless a count follows
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        bench_lookups(argc > 2 ? (size_t)strtoull(argv[2], NULL, 10) : BENCH_DEFAULT_RANGES);
+        return 0;
+    }
+
     printf("Test Input:\n");
     const char* test_input = "3-5\n"
                              "10-14\n"
@@ -267,7 +2087,9 @@ int main()
                              "32";
 
     FILE* test_stream = fmemopen((void*)test_input, strlen(test_input), "r");
-    parse_and_run(test_stream);
+    bool checks_ok = parse_and_run(test_stream, true);
+    rewind(test_stream);
+    stream_and_run(test_stream, STREAM_OUTPUT_NONE);
     fclose(test_stream);
 
     printf("Real Input:\n");
@@ -277,8 +2099,10 @@ int main()
         perror("Failed to open input file");
         return 1;
     }
-    parse_and_run(real_input_stream);
+    parse_and_run(real_input_stream, false);
+    rewind(real_input_stream);
+    stream_and_run(real_input_stream, STREAM_OUTPUT_NONE);
     fclose(real_input_stream);
 
-    return 0;
+    return checks_ok ? 0 : 1;
 }
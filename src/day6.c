@@ -1,308 +1,1054 @@
 #include <ctype.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 enum Operation {
     OP_ADD,
     OP_MUL,
 };
 
-struct operand {
-    uint64_t value;
-    size_t prepadding;
-    size_t postpadding;
+// Exact arithmetic for totals that outgrow 64 bits. A wide_int is an unsigned __int128 until an add or multiply
+// overflows it, after which it carries on as a little-endian base 2^64 big integer.
+struct bignum {
+    uint64_t* limbs;
+    size_t num_limbs;
+    size_t capacity;
 };
 
-struct problem {
-    struct operand operands[4];
-    enum Operation operation;
+struct wide_int {
+    unsigned __int128 small;
+    struct bignum* big;
+};
+
+static void bignum_push_limb(struct bignum* b, uint64_t limb)
+{
+    if (b->num_limbs == b->capacity) {
+        b->capacity *= 2;
+        b->limbs = realloc(b->limbs, b->capacity * sizeof(uint64_t));
+    }
+    b->limbs[b->num_limbs++] = limb;
+}
+
+struct bignum* new_bignum(unsigned __int128 value)
+{
+    struct bignum* b = malloc(sizeof(struct bignum));
+    b->capacity = 4;
+    b->num_limbs = 0;
+    b->limbs = malloc(b->capacity * sizeof(uint64_t));
+    bignum_push_limb(b, (uint64_t)value);
+    bignum_push_limb(b, (uint64_t)(value >> 64));
+    return b;
+}
+
+void free_bignum(struct bignum* b)
+{
+    if (b) {
+        free(b->limbs);
+        free(b);
+    }
+}
+
+// Adds `value` shifted left by `limb` limbs
+static void bignum_add_at(struct bignum* b, size_t limb, uint64_t value)
+{
+    while (value != 0) {
+        if (limb == b->num_limbs) {
+            bignum_push_limb(b, 0);
+        }
+        unsigned __int128 sum = (unsigned __int128)b->limbs[limb] + value;
+        b->limbs[limb++] = (uint64_t)sum;
+        value = (uint64_t)(sum >> 64);
+    }
+}
+
+void bignum_add_u128(struct bignum* b, unsigned __int128 value)
+{
+    bignum_add_at(b, 0, (uint64_t)value);
+    bignum_add_at(b, 1, (uint64_t)(value >> 64));
+}
+
+void bignum_add(struct bignum* b, const struct bignum* other)
+{
+    for (size_t i = 0; i < other->num_limbs; ++i) {
+        bignum_add_at(b, i, other->limbs[i]);
+    }
+}
+
+void bignum_mul_u64(struct bignum* b, uint64_t value)
+{
+    uint64_t carry = 0;
+    for (size_t i = 0; i < b->num_limbs; ++i) {
+        unsigned __int128 product = (unsigned __int128)b->limbs[i] * value + carry;
+        b->limbs[i] = (uint64_t)product;
+        carry = (uint64_t)(product >> 64);
+    }
+    if (carry != 0) {
+        bignum_push_limb(b, carry);
+    }
+}
+
+// Schoolbook product; the top limb may be left zero
+void bignum_mul(struct bignum* b, const struct bignum* other)
+{
+    size_t num_limbs = b->num_limbs + other->num_limbs;
+    uint64_t* limbs = calloc(num_limbs, sizeof(uint64_t));
+    for (size_t i = 0; i < b->num_limbs; ++i) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < other->num_limbs; ++j) {
+            unsigned __int128 cur = (unsigned __int128)b->limbs[i] * other->limbs[j] + limbs[i + j] + carry;
+            limbs[i + j] = (uint64_t)cur;
+            carry = (uint64_t)(cur >> 64);
+        }
+        limbs[i + other->num_limbs] = carry;
+    }
+    free(b->limbs);
+    b->limbs = limbs;
+    b->num_limbs = num_limbs;
+    b->capacity = num_limbs;
+}
+
+// Decimal digits, most significant first. The caller frees the result.
+char* bignum_to_string(const struct bignum* b)
+{
+    // Peel off base 10^19 chunks, least significant first
+    const uint64_t chunk_base = 10000000000000000000ull;
+    uint64_t* limbs = malloc(b->num_limbs * sizeof(uint64_t));
+    memcpy(limbs, b->limbs, b->num_limbs * sizeof(uint64_t));
+    size_t num_limbs = b->num_limbs;
+    uint64_t* chunks = malloc((2 * num_limbs + 1) * sizeof(uint64_t));
+    size_t num_chunks = 0;
+    do {
+        uint64_t remainder = 0;
+        for (size_t i = num_limbs; i > 0; --i) {
+            unsigned __int128 cur = ((unsigned __int128)remainder << 64) | limbs[i - 1];
+            limbs[i - 1] = (uint64_t)(cur / chunk_base);
+            remainder = (uint64_t)(cur % chunk_base);
+        }
+        chunks[num_chunks++] = remainder;
+        while (num_limbs > 0 && limbs[num_limbs - 1] == 0) {
+            --num_limbs;
+        }
+    } while (num_limbs > 0);
+
+    char* out = malloc(num_chunks * 19 + 1);
+    int len = sprintf(out, "%lu", chunks[num_chunks - 1]);
+    for (size_t i = num_chunks - 1; i > 0; --i) {
+        len += sprintf(out + len, "%019lu", chunks[i - 1]);
+    }
+    free(limbs);
+    free(chunks);
+    return out;
+}
+
+static void wide_int_promote(struct wide_int* w)
+{
+    if (!w->big) {
+        w->big = new_bignum(w->small);
+    }
+}
+
+void wide_int_add_u128(struct wide_int* w, unsigned __int128 value)
+{
+    if (!w->big) {
+        unsigned __int128 sum;
+        if (!__builtin_add_overflow(w->small, value, &sum)) {
+            w->small = sum;
+            return;
+        }
+        wide_int_promote(w);
+    }
+    bignum_add_u128(w->big, value);
+}
+
+void wide_int_mul_u64(struct wide_int* w, uint64_t value)
+{
+    if (!w->big) {
+        unsigned __int128 product;
+        if (!__builtin_mul_overflow(w->small, value, &product)) {
+            w->small = product;
+            return;
+        }
+        wide_int_promote(w);
+    }
+    bignum_mul_u64(w->big, value);
+}
+
+void wide_int_add(struct wide_int* w, const struct wide_int* other)
+{
+    if (!other->big) {
+        wide_int_add_u128(w, other->small);
+        return;
+    }
+    wide_int_promote(w);
+    bignum_add(w->big, other->big);
+}
+
+void wide_int_mul(struct wide_int* w, const struct wide_int* other)
+{
+    if (!other->big && other->small <= UINT64_MAX) {
+        wide_int_mul_u64(w, (uint64_t)other->small);
+        return;
+    }
+    wide_int_promote(w);
+    if (other->big) {
+        bignum_mul(w->big, other->big);
+        return;
+    }
+    struct bignum* factor = new_bignum(other->small);
+    bignum_mul(w->big, factor);
+    free_bignum(factor);
+}
+
+void free_wide_int(struct wide_int* w)
+{
+    free_bignum(w->big);
+    w->big = NULL;
+}
+
+// The caller frees the result.
+char* wide_int_to_string(const struct wide_int* w)
+{
+    if (w->big) {
+        return bignum_to_string(w->big);
+    }
+    char digits[40];
+    size_t len = 0;
+    unsigned __int128 value = w->small;
+    do {
+        digits[len++] = (char)('0' + (int)(value % 10));
+        value /= 10;
+    } while (value > 0);
+    char* out = malloc(len + 1);
+    for (size_t i = 0; i < len; ++i) {
+        out[i] = digits[len - 1 - i];
+    }
+    out[len] = '\0';
+    return out;
+}
+
+void print_wide_total(const char* label, const struct wide_int* total)
+{
+    char* digits = wide_int_to_string(total);
+    printf("%s total: %s\n", label, digits);
+    free(digits);
+}
+
+// Structure of arrays: operand row r of every problem is the contiguous column
+// operands[r * num_problems .. (r + 1) * num_problems), so evaluation streams through one row at a time no matter how
+// many rows the worksheet has. Problem i's part 2 operands, read down its text columns, are
+// vertical_operands[vertical_starts[i] .. vertical_starts[i + 1]).
+//
+// A vertical operand has one digit per operand row, so on tall worksheets it can outgrow 64 bits. Those are kept in
+// wide_vertical, sorted by the slot they occupy in vertical_operands, and their slot there holds 0.
+struct wide_operand {
+    size_t slot;
+    struct wide_int value;
 };
 
 struct math_homework {
-    struct problem* problems;
     size_t num_problems;
     size_t num_operands;
+    uint64_t* operands;
+    enum Operation* operations;
+    uint64_t* vertical_operands;
+    size_t* vertical_starts;
+    struct wide_operand* wide_vertical;
+    size_t num_wide_vertical;
+    size_t wide_vertical_capacity;
 };
 
-void free_math_homework(struct math_homework* mh) { free(mh->problems); }
+static inline const uint64_t* operand_row(const struct math_homework* mh, size_t row)
+{
+    return &mh->operands[row * mh->num_problems];
+}
 
-enum read_codes {
-    READ_ERROR = -1,
-    READ_NEWLINE = -2,
-    READ_OK_NO_NEWLINE = 0,
-    READ_OK_NEWLINE = 1,
+void free_math_homework(struct math_homework* mh)
+{
+    if (mh) {
+        free(mh->operands);
+        free(mh->operations);
+        free(mh->vertical_operands);
+        free(mh->vertical_starts);
+        for (size_t i = 0; i < mh->num_wide_vertical; ++i) {
+            free_wide_int(&mh->wide_vertical[i].value);
+        }
+        free(mh->wide_vertical);
+        free(mh);
+    }
+}
+
+// The whole worksheet as a character matrix, from the stream's current position on. A file that hasn't been read from
+// yet is mapped rather than read; anything else (pipes, fmemopen streams, a file partway through) is slurped into a
+// buffer. Rows keep their own lengths and are treated as space-padded to `width`.
+struct worksheet {
+    const char* text;
+    size_t length;
+    bool mapped;
+    size_t* row_starts;
+    size_t* row_lengths;
+    size_t num_rows;
+    size_t width;
 };
 
-size_t read_spaces(FILE* input_stream)
+static char* slurp_stream(FILE* input_stream, size_t* out_length)
 {
-    int ch = ' ';
-    size_t spaces = 0;
-    do {
-        ch = fgetc(input_stream);
-        if (ch == ' ') {
-            spaces++;
+    size_t capacity = 4096;
+    size_t length = 0;
+    char* buffer = malloc(capacity);
+    size_t n;
+    while ((n = fread(buffer + length, 1, capacity - length, input_stream)) > 0) {
+        length += n;
+        if (length == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
         }
-    } while (ch == ' ');
-    ungetc(ch, input_stream);
-    return spaces;
+    }
+    *out_length = length;
+    return buffer;
 }
 
-int read_number(FILE* input_stream, uint64_t* out_value)
+struct worksheet* load_worksheet(FILE* input_stream)
 {
-    char buffer[64];
-    size_t len = 0;
+    struct worksheet* ws = calloc(1, sizeof(struct worksheet));
 
-    int ch = fgetc(input_stream);
-    while (isdigit(ch) && len < sizeof(buffer) - 1) {
-        buffer[len++] = (char)ch;
-        ch = fgetc(input_stream);
+    struct stat st;
+    int fd = fileno(input_stream);
+    // ftell counts what the stream has buffered, so 0 means nothing has been consumed and the map can start at the top
+    if (fd >= 0 && ftell(input_stream) == 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            ws->text = map;
+            ws->length = (size_t)st.st_size;
+            ws->mapped = true;
+        }
+    }
+    if (!ws->mapped) {
+        ws->text = slurp_stream(input_stream, &ws->length);
     }
-    buffer[len] = '\0';
-    ungetc(ch, input_stream);
 
-    if (len == 0) {
-        return -1;
+    size_t row_capacity = 8;
+    ws->row_starts = malloc(row_capacity * sizeof(size_t));
+    ws->row_lengths = malloc(row_capacity * sizeof(size_t));
+    size_t pos = 0;
+    while (pos < ws->length) {
+        const char* newline = memchr(ws->text + pos, '\n', ws->length - pos);
+        size_t line_end = newline ? (size_t)(newline - ws->text) : ws->length;
+        size_t row_length = line_end - pos;
+        if (row_length > 0 && ws->text[pos + row_length - 1] == '\r') {
+            --row_length;
+        }
+        if (row_length > 0) {
+            if (ws->num_rows == row_capacity) {
+                row_capacity *= 2;
+                ws->row_starts = realloc(ws->row_starts, row_capacity * sizeof(size_t));
+                ws->row_lengths = realloc(ws->row_lengths, row_capacity * sizeof(size_t));
+            }
+            ws->row_starts[ws->num_rows] = pos;
+            ws->row_lengths[ws->num_rows] = row_length;
+            ws->num_rows++;
+            if (row_length > ws->width) {
+                ws->width = row_length;
+            }
+        }
+        pos = line_end + 1;
+    }
+    return ws;
+}
+
+void free_worksheet(struct worksheet* ws)
+{
+    if (!ws) {
+        return;
     }
-    int errno = 0;
-    *out_value = strtoull(buffer, NULL, 10);
-    if (errno != 0) {
-        return -1;
+    if (ws->mapped) {
+        munmap((void*)ws->text, ws->length);
+    } else {
+        free((void*)ws->text);
     }
-    return 0;
+    free(ws->row_starts);
+    free(ws->row_lengths);
+    free(ws);
 }
 
-struct math_homework* parse_math_homework(FILE* input_stream, size_t num_operands)
+static inline char worksheet_at(const struct worksheet* ws, size_t row, size_t col)
 {
-    struct math_homework* mh = malloc(sizeof(struct math_homework));
-    memset(mh, 0, sizeof(struct math_homework));
+    return col < ws->row_lengths[row] ? ws->text[ws->row_starts[row] + col] : ' ';
+}
 
-    // first line
-    size_t num_problems = 0;
-    int ret = 0;
-    size_t last_whitespace = SIZE_MAX;
-    while (true) {
-        size_t prepadding;
-        if (last_whitespace == SIZE_MAX) {
-            prepadding = read_spaces(input_stream);
-        } else {
-            prepadding = last_whitespace;
-        }
-        uint64_t value;
-        ret = read_number(input_stream, &value);
-        if (ret == -1) {
-            fprintf(stderr, "Error reading number\n");
-            abort();
+// Marks every column that has a non-space character in any row; problems are separated by unmarked columns. The
+// inner loop is a plain byte compare-and-or over each row, which the compiler vectorizes.
+static uint8_t* occupied_columns(const struct worksheet* ws)
+{
+    uint8_t* occupied = calloc(ws->width ? ws->width : 1, 1);
+    for (size_t r = 0; r < ws->num_rows; ++r) {
+        const char* row = ws->text + ws->row_starts[r];
+        size_t row_length = ws->row_lengths[r];
+        for (size_t c = 0; c < row_length; ++c) {
+            occupied[c] |= (uint8_t)(row[c] != ' ');
         }
-        size_t postpadding = read_spaces(input_stream);
-        last_whitespace = postpadding;
+    }
+    return occupied;
+}
 
-        mh->problems = realloc(mh->problems, sizeof(struct problem) * (num_problems + 1));
-        mh->problems[num_problems].operands[0]
-            = (struct operand) { .value = value, .prepadding = prepadding, .postpadding = postpadding };
-        ++num_problems;
+// False, leaving `value` alone, if the digit would take it past 64 bits
+static inline bool try_append_digit(uint64_t* value, char ch)
+{
+    uint64_t shifted;
+    uint64_t appended;
+    if (__builtin_mul_overflow(*value, 10, &shifted)
+        || __builtin_add_overflow(shifted, (uint64_t)(ch - '0'), &appended)) {
+        return false;
+    }
+    *value = appended;
+    return true;
+}
 
-        int ch = fgetc(input_stream);
-        if (ch == '\n') {
-            break;
-        } else {
-            ungetc(ch, input_stream);
+// Horizontal operands must fit in 64 bits; only vertical operands and the results operands combine into may grow
+// past that.
+static inline uint64_t append_digit(uint64_t value, char ch)
+{
+    if (!try_append_digit(&value, ch)) {
+        fprintf(stderr, "Operand does not fit in 64 bits\n");
+        abort();
+    }
+    return value;
+}
+
+static uint64_t read_digits(const struct worksheet* ws, size_t row, size_t first_col, size_t end_col, bool* any_digit)
+{
+    uint64_t value = 0;
+    *any_digit = false;
+    for (size_t c = first_col; c < end_col; ++c) {
+        char ch = worksheet_at(ws, row, c);
+        if (isdigit((unsigned char)ch)) {
+            value = append_digit(value, ch);
+            *any_digit = true;
+        }
+    }
+    return value;
+}
+
+static void add_problem(struct math_homework* mh, const struct worksheet* ws, size_t i, size_t first_col,
+    size_t end_col, size_t* vertical_capacity)
+{
+    // Horizontal operands: the digits of each operand row within the problem's columns
+    for (size_t r = 0; r < mh->num_operands; ++r) {
+        bool any_digit;
+        mh->operands[r * mh->num_problems + i] = read_digits(ws, r, first_col, end_col, &any_digit);
+        if (!any_digit) {
+            fprintf(stderr, "Missing operand in row %zu at column %zu\n", r, first_col);
+            abort();
         }
     }
 
-    mh->num_problems = num_problems;
-    mh->num_operands = num_operands;
-
-    for (size_t op_idx = 1; op_idx < num_operands; ++op_idx) {
-        last_whitespace = SIZE_MAX;
-        for (size_t i = 0; i < num_problems; ++i) {
-            size_t prepadding;
-            if (last_whitespace == SIZE_MAX) {
-                prepadding = read_spaces(input_stream);
-            } else {
-                prepadding = last_whitespace;
-            }
-            uint64_t value;
-            ret = read_number(input_stream, &value);
-            if (ret == -1) {
-                break;
+    // Vertical operands: the digits of each column, top to bottom
+    size_t num_vertical = mh->vertical_starts[i];
+    for (size_t c = first_col; c < end_col; ++c) {
+        uint64_t value = 0;
+        struct wide_int wide = { 0 };
+        bool is_wide = false;
+        bool any_digit = false;
+        for (size_t r = 0; r < mh->num_operands; ++r) {
+            char ch = worksheet_at(ws, r, c);
+            if (!isdigit((unsigned char)ch)) {
+                continue;
             }
-            size_t postpadding = read_spaces(input_stream);
-            last_whitespace = postpadding;
-
-            mh->problems[i].operands[op_idx]
-                = (struct operand) { .value = value, .prepadding = prepadding, .postpadding = postpadding };
-            int ch = fgetc(input_stream);
-            if (ch == '\n') {
+            any_digit = true;
+            if (!is_wide && try_append_digit(&value, ch)) {
                 continue;
-            } else {
-                ungetc(ch, input_stream);
             }
+            if (!is_wide) {
+                wide.small = value;
+                is_wide = true;
+            }
+            wide_int_mul_u64(&wide, 10);
+            wide_int_add_u128(&wide, (unsigned __int128)(ch - '0'));
+        }
+        if (!any_digit) {
+            continue;
+        }
+        if (num_vertical == *vertical_capacity) {
+            *vertical_capacity *= 2;
+            mh->vertical_operands = realloc(mh->vertical_operands, *vertical_capacity * sizeof(uint64_t));
+        }
+        if (is_wide) {
+            if (mh->num_wide_vertical == mh->wide_vertical_capacity) {
+                mh->wide_vertical_capacity = mh->wide_vertical_capacity ? 2 * mh->wide_vertical_capacity : 8;
+                mh->wide_vertical
+                    = realloc(mh->wide_vertical, mh->wide_vertical_capacity * sizeof(struct wide_operand));
+            }
+            mh->wide_vertical[mh->num_wide_vertical++] = (struct wide_operand) { .slot = num_vertical, .value = wide };
+            value = 0;
         }
+        mh->vertical_operands[num_vertical++] = value;
     }
+    mh->vertical_starts[i + 1] = num_vertical;
 
-    for (size_t i = 0; i < num_problems; ++i) {
+    char op_char = ' ';
+    for (size_t c = first_col; c < end_col && op_char == ' '; ++c) {
+        op_char = worksheet_at(ws, ws->num_rows - 1, c);
+    }
+    if (op_char == '+') {
+        mh->operations[i] = OP_ADD;
+    } else if (op_char == '*') {
+        mh->operations[i] = OP_MUL;
+    } else {
+        fprintf(stderr, "Unknown operation '%c' at column %zu\n", op_char, first_col);
+        abort();
+    }
+}
 
-        int op_char = ' ';
-        do {
-            op_char = fgetc(input_stream);
-        } while (op_char != '+' && op_char != '*' && op_char != EOF);
+struct math_homework* parse_math_homework(FILE* input_stream)
+{
+    struct worksheet* ws = load_worksheet(input_stream);
+    if (ws->num_rows < 2) {
+        fprintf(stderr, "Worksheet needs at least one operand row and an operator row\n");
+        abort();
+    }
 
-        if (op_char == '+') {
-            mh->problems[i].operation = OP_ADD;
-        } else if (op_char == '*') {
-            mh->problems[i].operation = OP_MUL;
-        } else {
-            // unknown operation
+    // Problem spans first, so the operand columns can be sized up front
+    uint8_t* occupied = occupied_columns(ws);
+    size_t* span_starts = malloc((ws->width / 2 + 1) * sizeof(size_t));
+    size_t* span_ends = malloc((ws->width / 2 + 1) * sizeof(size_t));
+    size_t num_problems = 0;
+    size_t c = 0;
+    while (c < ws->width) {
+        if (!occupied[c]) {
+            ++c;
+            continue;
         }
+        span_starts[num_problems] = c;
+        while (c < ws->width && occupied[c]) {
+            ++c;
+        }
+        span_ends[num_problems++] = c;
+    }
+    free(occupied);
+
+    struct math_homework* mh = calloc(1, sizeof(struct math_homework));
+    mh->num_problems = num_problems;
+    mh->num_operands = ws->num_rows - 1;
+    mh->operands = malloc((mh->num_operands * num_problems + 1) * sizeof(uint64_t));
+    mh->operations = malloc((num_problems + 1) * sizeof(enum Operation));
+    mh->vertical_starts = malloc((num_problems + 1) * sizeof(size_t));
+    mh->vertical_starts[0] = 0;
+    size_t vertical_capacity = 64;
+    mh->vertical_operands = malloc(vertical_capacity * sizeof(uint64_t));
+
+    for (size_t i = 0; i < num_problems; ++i) {
+        add_problem(mh, ws, i, span_starts[i], span_ends[i], &vertical_capacity);
     }
 
+    free(span_starts);
+    free(span_ends);
+    free_worksheet(ws);
     return mh;
 }
 
 void print_math_homework(struct math_homework* mh)
 {
     for (size_t i = 0; i < mh->num_problems; ++i) {
-        struct problem prob = mh->problems[i];
-        char op_char = (prob.operation == OP_ADD) ? '+' : '*';
+        char op_char = (mh->operations[i] == OP_ADD) ? '+' : '*';
         for (size_t j = 0; j < mh->num_operands; ++j) {
-            printf("%lu %c ", prob.operands[j].value, op_char);
+            printf("%lu %c ", operand_row(mh, j)[i], op_char);
         }
         printf("\n");
     }
 }
 
-void part1(struct math_homework* mh)
+enum homework_part {
+    PART_HORIZONTAL,
+    PART_VERTICAL,
+};
+
+// The worksheet regrouped by operation, each group as its own structure of arrays: operand row j of the additions is
+// add_operands[j * num_add .. (j + 1) * num_add), and likewise for the multiplications, so both folds run over
+// contiguous rows. Vertical operands are regrouped the same way, with add_vertical_starts and mul_vertical_starts
+// giving each problem's run, and wide vertical operands are regrouped into add_wide and mul_wide with their slots
+// renumbered to match; their values still belong to the homework. Additions don't need evaluating one problem at a
+// time, since their share of the grand total is just the sum of all their operands.
+struct op_partition {
+    size_t num_operands;
+    size_t num_add;
+    size_t num_mul;
+    uint64_t* add_operands;
+    uint64_t* mul_operands;
+    uint64_t* add_vertical;
+    size_t* add_vertical_starts;
+    uint64_t* mul_vertical;
+    size_t* mul_vertical_starts;
+    struct wide_operand* add_wide;
+    size_t num_add_wide;
+    struct wide_operand* mul_wide;
+    size_t num_mul_wide;
+};
+
+struct op_partition* new_op_partition(const struct math_homework* mh)
 {
-    uint64_t total = 0;
+    struct op_partition* part = calloc(1, sizeof(struct op_partition));
+    part->num_operands = mh->num_operands;
     for (size_t i = 0; i < mh->num_problems; ++i) {
-        struct problem prob = mh->problems[i];
-        uint64_t result = prob.operands[0].value;
-        for (size_t j = 1; j < mh->num_operands; ++j) {
-            if (prob.operation == OP_ADD) {
-                result += prob.operands[j].value;
-            } else if (prob.operation == OP_MUL) {
-                result *= prob.operands[j].value;
+        part->num_add += mh->operations[i] == OP_ADD;
+    }
+    part->num_mul = mh->num_problems - part->num_add;
+    part->add_operands = malloc((mh->num_operands * part->num_add + 1) * sizeof(uint64_t));
+    part->mul_operands = malloc((mh->num_operands * part->num_mul + 1) * sizeof(uint64_t));
+    size_t num_vertical = mh->vertical_starts[mh->num_problems];
+    part->add_vertical = malloc((num_vertical + 1) * sizeof(uint64_t));
+    part->mul_vertical = malloc((num_vertical + 1) * sizeof(uint64_t));
+    part->add_vertical_starts = malloc((part->num_add + 1) * sizeof(size_t));
+    part->mul_vertical_starts = malloc((part->num_mul + 1) * sizeof(size_t));
+    part->add_vertical_starts[0] = 0;
+    part->mul_vertical_starts[0] = 0;
+    part->add_wide = malloc((mh->num_wide_vertical + 1) * sizeof(struct wide_operand));
+    part->mul_wide = malloc((mh->num_wide_vertical + 1) * sizeof(struct wide_operand));
+
+    size_t a = 0;
+    size_t m = 0;
+    size_t w = 0;
+    for (size_t i = 0; i < mh->num_problems; ++i) {
+        const uint64_t* vertical = &mh->vertical_operands[mh->vertical_starts[i]];
+        size_t num_problem_vertical = mh->vertical_starts[i + 1] - mh->vertical_starts[i];
+        size_t first_slot;
+        if (mh->operations[i] == OP_ADD) {
+            for (size_t j = 0; j < mh->num_operands; ++j) {
+                part->add_operands[j * part->num_add + a] = operand_row(mh, j)[i];
+            }
+            first_slot = part->add_vertical_starts[a];
+            memcpy(&part->add_vertical[first_slot], vertical, num_problem_vertical * sizeof(uint64_t));
+            part->add_vertical_starts[a + 1] = first_slot + num_problem_vertical;
+            ++a;
+        } else {
+            for (size_t j = 0; j < mh->num_operands; ++j) {
+                part->mul_operands[j * part->num_mul + m] = operand_row(mh, j)[i];
+            }
+            first_slot = part->mul_vertical_starts[m];
+            memcpy(&part->mul_vertical[first_slot], vertical, num_problem_vertical * sizeof(uint64_t));
+            part->mul_vertical_starts[m + 1] = first_slot + num_problem_vertical;
+            ++m;
+        }
+        for (; w < mh->num_wide_vertical && mh->wide_vertical[w].slot < mh->vertical_starts[i + 1]; ++w) {
+            struct wide_operand wide = mh->wide_vertical[w];
+            wide.slot = first_slot + wide.slot - mh->vertical_starts[i];
+            if (mh->operations[i] == OP_ADD) {
+                part->add_wide[part->num_add_wide++] = wide;
+            } else {
+                part->mul_wide[part->num_mul_wide++] = wide;
             }
         }
-        total += result;
     }
-    printf("Part 1 total: %lu\n", total);
+    return part;
 }
 
-size_t count_digits(uint64_t value)
+void free_op_partition(struct op_partition* part)
 {
-    size_t digit_count = 0;
-    do {
-        digit_count++;
-        value /= 10;
-    } while (value > 0);
-    return digit_count;
+    if (part) {
+        free(part->add_operands);
+        free(part->mul_operands);
+        free(part->add_vertical);
+        free(part->add_vertical_starts);
+        free(part->mul_vertical);
+        free(part->mul_vertical_starts);
+        free(part->add_wide);
+        free(part->mul_wide);
+        free(part);
+    }
 }
 
-uint64_t get_digit(uint64_t value, size_t digit_index)
+// Sum of n values. The 32-bit halves are summed separately so each lane can accumulate in 64 bits without carries,
+// which keeps the inner loop branch-free and lets the compiler vectorize it.
+static unsigned __int128 wide_sum(const uint64_t* values, size_t n)
 {
-    for (size_t i = 0; i < digit_index; ++i) {
-        value /= 10;
+    const size_t block = (size_t)1 << 31;
+    unsigned __int128 total = 0;
+    for (size_t start = 0; start < n; start += block) {
+        size_t end = n - start < block ? n : start + block;
+        uint64_t low = 0;
+        uint64_t high = 0;
+        for (size_t i = start; i < end; ++i) {
+            low += values[i] & UINT32_MAX;
+            high += values[i] >> 32;
+        }
+        total += ((unsigned __int128)high << 32) + low;
     }
-    return value % 10;
+    return total;
 }
 
-void part2(struct math_homework* mh)
+// Exact product of multiplication k from scratch, for the ones that overflowed 128 bits
+static struct wide_int mul_problem_wide(const struct op_partition* part, size_t k)
 {
-    // Get max digit counts per problem
-    size_t* max_digit_counts = calloc(mh->num_problems, sizeof(uint64_t));
-    for (size_t i = 0; i < mh->num_problems; ++i) {
-        struct problem prob = mh->problems[i];
-        for (size_t j = 0; j < mh->num_operands; ++j) {
-            uint64_t value = prob.operands[j].value;
-            size_t digit_count = count_digits(value);
-            if (digit_count > max_digit_counts[i]) {
-                max_digit_counts[i] = digit_count;
+    struct wide_int result = { .small = part->mul_operands[k] };
+    for (size_t j = 1; j < part->num_operands; ++j) {
+        wide_int_mul_u64(&result, part->mul_operands[j * part->num_mul + k]);
+    }
+    return result;
+}
+
+// Additions [add_begin, add_end) and multiplications [mul_begin, mul_end) of one part, evaluated by one thread
+struct eval_chunk {
+    const struct op_partition* part;
+    enum homework_part which;
+    size_t add_begin;
+    size_t add_end;
+    size_t mul_begin;
+    size_t mul_end;
+    struct wide_int total;
+};
+
+static void eval_chunk_horizontal(struct eval_chunk* chunk)
+{
+    const struct op_partition* part = chunk->part;
+    for (size_t j = 0; j < part->num_operands; ++j) {
+        const uint64_t* row = &part->add_operands[j * part->num_add];
+        wide_int_add_u128(&chunk->total, wide_sum(row + chunk->add_begin, chunk->add_end - chunk->add_begin));
+    }
+
+    // Multiplications: fold one contiguous operand row at a time in 128 bits, noting which products overflow
+    size_t num_mul = chunk->mul_end - chunk->mul_begin;
+    unsigned __int128* results = malloc((num_mul + 1) * sizeof(unsigned __int128));
+    bool* overflowed = calloc(num_mul + 1, sizeof(bool));
+    const uint64_t* row0 = &part->mul_operands[chunk->mul_begin];
+    for (size_t k = 0; k < num_mul; ++k) {
+        results[k] = row0[k];
+    }
+    for (size_t j = 1; j < part->num_operands; ++j) {
+        const uint64_t* row = &part->mul_operands[j * part->num_mul + chunk->mul_begin];
+        for (size_t k = 0; k < num_mul; ++k) {
+            overflowed[k] |= __builtin_mul_overflow(results[k], row[k], &results[k]);
+        }
+    }
+    for (size_t k = 0; k < num_mul; ++k) {
+        if (!overflowed[k]) {
+            wide_int_add_u128(&chunk->total, results[k]);
+            continue;
+        }
+        struct wide_int exact = mul_problem_wide(part, chunk->mul_begin + k);
+        wide_int_add(&chunk->total, &exact);
+        free_wide_int(&exact);
+    }
+    free(results);
+    free(overflowed);
+}
+
+// Index of the first wide operand at or after `slot`
+static size_t first_wide_at(const struct wide_operand* wide, size_t num_wide, size_t slot)
+{
+    size_t lo = 0;
+    size_t hi = num_wide;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (wide[mid].slot < slot) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void eval_chunk_vertical(struct eval_chunk* chunk)
+{
+    const struct op_partition* part = chunk->part;
+    size_t first_vertical = part->add_vertical_starts[chunk->add_begin];
+    size_t end_vertical = part->add_vertical_starts[chunk->add_end];
+    wide_int_add_u128(&chunk->total, wide_sum(part->add_vertical + first_vertical, end_vertical - first_vertical));
+    // Wide operands sit in the sum as 0, so they are added on their own
+    for (size_t w = first_wide_at(part->add_wide, part->num_add_wide, first_vertical);
+        w < part->num_add_wide && part->add_wide[w].slot < end_vertical; ++w) {
+        wide_int_add(&chunk->total, &part->add_wide[w].value);
+    }
+
+    size_t w = first_wide_at(part->mul_wide, part->num_mul_wide, part->mul_vertical_starts[chunk->mul_begin]);
+    for (size_t k = chunk->mul_begin; k < chunk->mul_end; ++k) {
+        size_t first_slot = part->mul_vertical_starts[k];
+        size_t num_vertical = part->mul_vertical_starts[k + 1] - first_slot;
+        const uint64_t* vertical = &part->mul_vertical[first_slot];
+        unsigned __int128 product = 1;
+        bool overflowed = w < part->num_mul_wide && part->mul_wide[w].slot < first_slot + num_vertical;
+        for (size_t d = 0; d < num_vertical; ++d) {
+            overflowed |= __builtin_mul_overflow(product, vertical[d], &product);
+        }
+        if (!overflowed) {
+            wide_int_add_u128(&chunk->total, product);
+            continue;
+        }
+        struct wide_int exact = { .small = 1 };
+        for (size_t d = 0; d < num_vertical; ++d) {
+            if (w < part->num_mul_wide && part->mul_wide[w].slot == first_slot + d) {
+                wide_int_mul(&exact, &part->mul_wide[w++].value);
+            } else {
+                wide_int_mul_u64(&exact, vertical[d]);
             }
         }
+        wide_int_add(&chunk->total, &exact);
+        free_wide_int(&exact);
+    }
+}
+
+static void* eval_chunk_run(void* arg)
+{
+    struct eval_chunk* chunk = (struct eval_chunk*)arg;
+    if (chunk->which == PART_HORIZONTAL) {
+        eval_chunk_horizontal(chunk);
+    } else {
+        eval_chunk_vertical(chunk);
+    }
+    return NULL;
+}
+
+#define PARALLEL_EVAL_MIN ((size_t)1 << 16)
+
+size_t online_cpu_count(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+static inline size_t chunk_bound(size_t t, size_t n, size_t num_threads)
+{
+    size_t per_thread = (n + num_threads - 1) / num_threads;
+    return t * per_thread < n ? t * per_thread : n;
+}
+
+// Grand total of one part. Chunk t gets the t-th slice of the additions and the t-th slice of the multiplications;
+// chunk 0 runs on the calling thread and the rest on their own threads. Chunk totals are combined in chunk order, so
+// the result never depends on scheduling. The caller frees the result with free_wide_int.
+struct wide_int evaluate_homework(const struct op_partition* part, enum homework_part which, size_t num_threads)
+{
+    if (num_threads == 0) {
+        num_threads = 1;
+    }
+    struct eval_chunk* chunks = calloc(num_threads, sizeof(struct eval_chunk));
+    pthread_t* threads = calloc(num_threads, sizeof(pthread_t));
+
+    for (size_t t = 0; t < num_threads; ++t) {
+        chunks[t] = (struct eval_chunk) {
+            .part = part,
+            .which = which,
+            .add_begin = chunk_bound(t, part->num_add, num_threads),
+            .add_end = chunk_bound(t + 1, part->num_add, num_threads),
+            .mul_begin = chunk_bound(t, part->num_mul, num_threads),
+            .mul_end = chunk_bound(t + 1, part->num_mul, num_threads),
+        };
+        if (t > 0 && pthread_create(&threads[t], NULL, &eval_chunk_run, &chunks[t]) != 0) {
+            perror("Failed to start evaluation thread");
+            abort();
+        }
     }
+    eval_chunk_run(&chunks[0]);
 
-    // Disambiguate pre- and post-padding
-    for (size_t op_idx = 0; op_idx < mh->num_operands; ++op_idx) {
-        size_t carry_postpad = 0;
-        bool first = true;
-        for (size_t i = 0; i < mh->num_problems; ++i) {
-            struct problem prob = mh->problems[i];
-            size_t raw_prepad = prob.operands[op_idx].prepadding;
+    struct wide_int total = chunks[0].total;
+    for (size_t t = 1; t < num_threads; ++t) {
+        pthread_join(threads[t], NULL);
+        wide_int_add(&total, &chunks[t].total);
+        free_wide_int(&chunks[t].total);
+    }
+
+    free(threads);
+    free(chunks);
+    return total;
+}
 
-            size_t effective_prepad = raw_prepad - carry_postpad - (first ? 0 : 1);
-            first = false;
-            size_t digit_count = count_digits(prob.operands[op_idx].value);
-            size_t spaces = max_digit_counts[i] - digit_count;
-            size_t effective_postpad = spaces - effective_prepad;
-            mh->problems[i].operands[op_idx].prepadding = effective_prepad;
-            mh->problems[i].operands[op_idx].postpadding = effective_postpad;
-            carry_postpad = effective_postpad;
+static size_t eval_thread_count(const struct math_homework* mh)
+{
+    size_t cpus = online_cpu_count();
+    return mh->num_problems >= PARALLEL_EVAL_MIN && cpus > 1 ? cpus : 1;
+}
+
+void part1(const struct math_homework* mh, const struct op_partition* part)
+{
+    struct wide_int total = evaluate_homework(part, PART_HORIZONTAL, eval_thread_count(mh));
+    print_wide_total("Part 1", &total);
+    free_wide_int(&total);
+}
+
+void part2(const struct math_homework* mh, const struct op_partition* part)
+{
+    struct wide_int grand_total = evaluate_homework(part, PART_VERTICAL, eval_thread_count(mh));
+    print_wide_total("Part 2", &grand_total);
+    free_wide_int(&grand_total);
+}
+
+// Part 1 without holding the worksheet: the k-th number on every operand row belongs to the k-th problem, so each
+// problem only needs a running sum and a running product until the operator row says which one to keep. Memory is
+// O(problems) whatever the number of rows. Sums are kept in 128 bits, which would take 2^64 rows to overflow, and
+// products are wide_ints.
+struct column_stream {
+    unsigned __int128* sums;
+    struct wide_int* products;
+    uint64_t* row;
+    size_t num_columns;
+    size_t capacity;
+    size_t rows_seen;
+    bool finished;
+    struct wide_int total;
+};
+
+struct column_stream* new_column_stream(void)
+{
+    struct column_stream* cs = calloc(1, sizeof(struct column_stream));
+    cs->capacity = 64;
+    cs->sums = malloc(cs->capacity * sizeof(unsigned __int128));
+    cs->products = malloc(cs->capacity * sizeof(struct wide_int));
+    cs->row = malloc(cs->capacity * sizeof(uint64_t));
+    return cs;
+}
+
+void free_column_stream(struct column_stream* cs)
+{
+    if (cs) {
+        for (size_t i = 0; i < cs->num_columns; ++i) {
+            free_wide_int(&cs->products[i]);
         }
+        free_wide_int(&cs->total);
+        free(cs->sums);
+        free(cs->products);
+        free(cs->row);
+        free(cs);
     }
+}
 
-    uint64_t grand_total = 0;
-    for (size_t i = 0; i < mh->num_problems; ++i) {
-        size_t max_dc = max_digit_counts[i];
-        enum Operation op_type = mh->problems[i].operation;
-        uint64_t accumulated_result = op_type == OP_ADD ? 0 : 1;
-
-        // For each digit column ...
-        for (size_t d = 0; d < max_dc; ++d) {
-
-            // build a "vertical" operand from that digit column
-            uint64_t vert_operand = 0;
-            uint64_t place_scalar = 1;
-            for (size_t jj = mh->num_operands; jj > 0; --jj) {
-                size_t j = jj - 1;
-
-                struct operand op = mh->problems[i].operands[j];
-                uint64_t value = op.value;
-                size_t digit_count = count_digits(value);
-                size_t left_shift = max_digit_counts[i] - digit_count - op.prepadding;
-
-                if (d < left_shift) {
-                    continue;
-                }
-                if (d > digit_count + left_shift - 1) {
-                    continue;
-                }
-                size_t effective_read_digit = d - left_shift;
-
-                uint64_t digit = get_digit(value, effective_read_digit);
-                vert_operand += digit * place_scalar;
-                place_scalar *= 10;
-            }
+static void column_stream_push_operator_row(struct column_stream* cs, const char* line, size_t len)
+{
+    size_t k = 0;
+    for (size_t c = 0; c < len; ++c) {
+        if (line[c] != '+' && line[c] != '*') {
+            continue;
+        }
+        if (k == cs->num_columns) {
+            fprintf(stderr, "Operator row has more than %zu problems\n", cs->num_columns);
+            abort();
+        }
+        if (line[c] == '+') {
+            wide_int_add_u128(&cs->total, cs->sums[k]);
+        } else {
+            wide_int_add(&cs->total, &cs->products[k]);
+        }
+        ++k;
+    }
+    if (k != cs->num_columns) {
+        fprintf(stderr, "Operator row has %zu problems, expected %zu\n", k, cs->num_columns);
+        abort();
+    }
+    cs->finished = true;
+}
+
+void column_stream_push_row(struct column_stream* cs, const char* line, size_t len)
+{
+    if (cs->finished) {
+        return;
+    }
 
-            // Do the operation with the vertical operand
-            if (op_type == OP_ADD) {
-                accumulated_result += vert_operand;
-            } else if (op_type == OP_MUL) {
-                accumulated_result *= vert_operand;
+    size_t c = 0;
+    while (c < len && line[c] == ' ') {
+        ++c;
+    }
+    if (c < len && (line[c] == '+' || line[c] == '*')) {
+        column_stream_push_operator_row(cs, line, len);
+        return;
+    }
+
+    size_t k = 0;
+    while (c < len) {
+        if (!isdigit((unsigned char)line[c])) {
+            ++c;
+            continue;
+        }
+        uint64_t value = 0;
+        while (c < len && isdigit((unsigned char)line[c])) {
+            value = append_digit(value, line[c]);
+            ++c;
+        }
+        if (k == cs->capacity) {
+            if (cs->rows_seen > 0) {
+                fprintf(stderr, "Row %zu has more than %zu numbers\n", cs->rows_seen, cs->num_columns);
+                abort();
             }
+            cs->capacity *= 2;
+            cs->sums = realloc(cs->sums, cs->capacity * sizeof(unsigned __int128));
+            cs->products = realloc(cs->products, cs->capacity * sizeof(struct wide_int));
+            cs->row = realloc(cs->row, cs->capacity * sizeof(uint64_t));
+        }
+        cs->row[k++] = value;
+    }
+
+    if (cs->rows_seen == 0) {
+        cs->num_columns = k;
+        for (size_t i = 0; i < k; ++i) {
+            cs->sums[i] = cs->row[i];
+            cs->products[i] = (struct wide_int) { .small = cs->row[i] };
         }
+    } else {
+        if (k != cs->num_columns) {
+            fprintf(stderr, "Row %zu has %zu numbers, expected %zu\n", cs->rows_seen, k, cs->num_columns);
+            abort();
+        }
+        // A plain element-wise add, which the compiler vectorizes
+        for (size_t i = 0; i < k; ++i) {
+            cs->sums[i] += cs->row[i];
+        }
+        for (size_t i = 0; i < k; ++i) {
+            wide_int_mul_u64(&cs->products[i], cs->row[i]);
+        }
+    }
+    cs->rows_seen++;
+}
 
-        // Accumulate the result
-        grand_total += accumulated_result;
+// The caller frees the result with free_wide_int.
+struct wide_int part1_streaming(FILE* stream)
+{
+    struct column_stream* cs = new_column_stream();
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+    while ((line_length = getline(&line, &line_capacity, stream)) > 0) {
+        size_t len = (size_t)line_length;
+        if (line[len - 1] == '\n') {
+            --len;
+        }
+        if (len == 0) {
+            break;
+        }
+        column_stream_push_row(cs, line, len);
     }
-    printf("Part 2 total: %lu\n", grand_total);
+    free(line);
 
-    free(max_digit_counts);
+    if (!cs->finished) {
+        fprintf(stderr, "Worksheet ended before the operator row\n");
+        abort();
+    }
+    struct wide_int total = cs->total;
+    cs->total = (struct wide_int) { 0 };
+    free_column_stream(cs);
+    return total;
 }
 
-void parse_and_run(FILE* input_stream, size_t num_operands)
+void parse_and_run(FILE* input_stream)
 {
-    struct math_homework* mh = parse_math_homework(input_stream, num_operands);
+    struct math_homework* mh = parse_math_homework(input_stream);
     // print_math_homework(mh);
-    part1(mh);
-    part2(mh);
+    struct op_partition* part = new_op_partition(mh);
+    part1(mh, part);
+    part2(mh, part);
 
+    free_op_partition(part);
     free_math_homework(mh);
 }
 
+void stream_and_run(FILE* input_stream)
+{
+    struct wide_int total = part1_streaming(input_stream);
+    print_wide_total("Part 1 (streaming)", &total);
+    free_wide_int(&total);
+}
+
 int main()
 {
     printf("Test Input:\n");
@@ -312,9 +1058,25 @@ int main()
                              "*   +   *   +  \n";
 
     FILE* test_stream = fmemopen((void*)test_input, strlen(test_input), "r");
-    parse_and_run(test_stream, 3);
+    parse_and_run(test_stream);
+    rewind(test_stream);
+    stream_and_run(test_stream);
     fclose(test_stream);
 
+    // 25 operand rows, so every part 2 operand is 25 digits long
+    printf("Tall Test Input:\n");
+    char tall_input[26 * 4 + 1];
+    for (size_t r = 0; r < 25; ++r) {
+        memcpy(&tall_input[r * 4], "9 1\n", 4);
+    }
+    strcpy(&tall_input[25 * 4], "* +\n");
+
+    FILE* tall_stream = fmemopen(tall_input, strlen(tall_input), "r");
+    parse_and_run(tall_stream);
+    rewind(tall_stream);
+    stream_and_run(tall_stream);
+    fclose(tall_stream);
+
     printf("Real Input:\n");
 
     FILE* real_input_stream = fopen("../inputs/day6", "r");
@@ -322,7 +1084,9 @@ int main()
         perror("Failed to open input file");
         return 1;
     }
-    parse_and_run(real_input_stream, 4);
+    parse_and_run(real_input_stream);
+    rewind(real_input_stream);
+    stream_and_run(real_input_stream);
     fclose(real_input_stream);
 
     return 0;
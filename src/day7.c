@@ -5,111 +5,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct sorted_array {
-    size_t capacity;
-    size_t size;
-    int64_t* items;
-};
-
-void sorted_array_free(struct sorted_array* sa)
-{
-    if (sa) {
-        free(sa->items);
-        free(sa);
-    }
-}
-
-struct sorted_array* sorted_array_new(size_t capacity)
-{
-    struct sorted_array* sa = malloc(sizeof(struct sorted_array));
-    sa->capacity = capacity;
-    sa->size = 0;
-    sa->items = malloc(capacity * sizeof(size_t));
-    return sa;
-}
-
-struct found {
-    bool found;
-    size_t index;
-};
-
-struct found insert_point(const void* key, const void* base, size_t nmemb, size_t size, __compar_fn_t compar)
-{
-    size_t l = 0;
-    size_t u = nmemb;
-
-    if (nmemb == 0) {
-        return (struct found) { .found = false, .index = 0 };
-    }
-
-    while (l < u) {
-        size_t idx = (l + u) / 2;
-        const void* cur = (const void*)(((const char*)base) + (idx * size));
-        int comparison = (*compar)(cur, key);
-        if (comparison < 0) {
-            l = idx + 1;
-        } else if (comparison > 0) {
-            u = idx;
-        } else {
-            return (struct found) { .found = true, .index = idx };
-        }
-    }
-
-    return (struct found) { .found = false, .index = u };
-}
-
-int int64_cmp(const void* a, const void* b)
-{
-    const int64_t* ra = (const int64_t*)a;
-    const int64_t* rb = (const int64_t*)b;
-
-    if (*ra < *rb) {
-        return -1;
-    } else if (*ra > *rb) {
-        return 1;
-    } else {
-        return 0;
-    }
-}
-
-void sorted_array_insert(struct sorted_array* sa, int64_t item)
-{
-    if (sa->size >= sa->capacity) {
-        while (sa->capacity <= sa->size) {
-            sa->capacity *= 2;
-        }
-        sa->items = realloc(sa->items, sa->capacity * sizeof(int64_t));
-    }
-
-    struct found insert_result = insert_point(&item, sa->items, sa->size, sizeof(int64_t), int64_cmp);
-    if (insert_result.found) {
-        return;
-    }
-    size_t i = insert_result.index;
-
-    memmove(&sa->items[i + 1], &sa->items[i], (sa->size - i) * sizeof(int64_t));
-    sa->items[i] = item;
-    sa->size++;
-}
-
-void sorted_array_remove(struct sorted_array* sa, int64_t item)
-{
-    struct found search_result = insert_point(&item, sa->items, sa->size, sizeof(int64_t), int64_cmp);
-    if (!search_result.found) {
-        return;
-    }
-
-    size_t i = search_result.index;
-    memmove(&sa->items[i], &sa->items[i + 1], (sa->size - i - 1) * sizeof(int64_t));
-    sa->size--;
-}
-
-bool sorted_array_contains(const struct sorted_array* sa, int64_t item)
-{
-    void* search_ret = bsearch(&item, sa->items, sa->size, sizeof(int64_t), int64_cmp);
-    return search_ret != NULL;
-}
-
 struct int2 {
     int64_t x;
     int64_t y;
@@ -200,128 +95,331 @@ void print_tachyon_manifold(struct tachyon_manifold* tm)
     }
 }
 
+// One splitter row of part 1 on bitsets of `num_words` 64-bit words, bit x being column x. Beams that hit a
+// splitter stop and continue one column to either side; those shifted past either edge drop out. Returns the number
+// of splits.
+static size_t split_beams(uint64_t* beams, uint64_t* hits, const uint64_t* splitters, size_t num_words, size_t width)
+{
+    size_t split_count = 0;
+    for (size_t w = 0; w < num_words; ++w) {
+        hits[w] = beams[w] & splitters[w];
+        split_count += (size_t)__builtin_popcountll(hits[w]);
+    }
+    for (size_t w = 0; w < num_words; ++w) {
+        uint64_t left = hits[w] >> 1 | (w + 1 < num_words ? hits[w + 1] << 63 : 0);
+        uint64_t right = hits[w] << 1 | (w > 0 ? hits[w - 1] >> 63 : 0);
+        beams[w] = (beams[w] & ~hits[w]) | left | right;
+    }
+    if (width % 64 != 0) {
+        beams[num_words - 1] &= ((uint64_t)1 << (width % 64)) - 1;
+    }
+    return split_count;
+}
+
 void part1(struct tachyon_manifold* tm)
 {
-    int64_t start_x = tm->start.x;
-    struct sorted_array* beams = sorted_array_new(tm->num_splitters);
-    sorted_array_insert(beams, start_x);
+    size_t num_words = (tm->width + 63) / 64;
+    uint64_t* beams = calloc(num_words, sizeof(uint64_t));
+    uint64_t* hits = calloc(num_words, sizeof(uint64_t));
+    uint64_t* splitters = calloc(num_words, sizeof(uint64_t));
+    size_t start_x = (size_t)tm->start.x;
+    beams[start_x / 64] = (uint64_t)1 << (start_x % 64);
 
     size_t split_count = 0;
 
-    for (size_t i = 0; i < tm->num_splitters; ++i) {
-        int64_t splitter_x = tm->splitters[i].x;
-        if (sorted_array_contains(beams, splitter_x)) {
-            sorted_array_remove(beams, splitter_x);
-            ++split_count;
-            if (splitter_x > 0) {
-                sorted_array_insert(beams, splitter_x + 1);
+    // Splitters are stored in row-major order, so each splitter row is a contiguous run of them.
+    size_t i = 0;
+    while (i < tm->num_splitters) {
+        int64_t y = tm->splitters[i].y;
+        size_t row_end = i;
+        while (row_end < tm->num_splitters && tm->splitters[row_end].y == y) {
+            ++row_end;
+        }
+        if (y > tm->start.y) {
+            for (size_t j = i; j < row_end; ++j) {
+                size_t x = (size_t)tm->splitters[j].x;
+                splitters[x / 64] |= (uint64_t)1 << (x % 64);
             }
-            if (splitter_x + 1 < (int64_t)tm->width) {
-                sorted_array_insert(beams, splitter_x + 1);
+            split_count += split_beams(beams, hits, splitters, num_words, tm->width);
+            for (size_t j = i; j < row_end; ++j) {
+                splitters[(size_t)tm->splitters[j].x / 64] = 0;
             }
-            sorted_array_insert(beams, splitter_x - 1);
         }
+        i = row_end;
     }
 
     printf("Part 1: Number of splits through splitters: %zu\n", split_count);
 
-    sorted_array_free(beams);
+    free(beams);
+    free(hits);
+    free(splitters);
 }
 
-size_t paths_count2(struct tachyon_manifold* tm, size_t splitter_index, size_t** memo)
+// Exact path counts for manifolds deep enough to outgrow 128 bits. A wide_int is an unsigned __int128 until an add
+// overflows it, after which it carries on as a little-endian base 2^64 big integer.
+struct bignum {
+    uint64_t* limbs;
+    size_t num_limbs;
+    size_t capacity;
+};
+
+struct wide_int {
+    unsigned __int128 small;
+    struct bignum* big;
+};
+
+static void bignum_push_limb(struct bignum* b, uint64_t limb)
 {
-    if (memo[splitter_index]) {
-        return *memo[splitter_index];
+    if (b->num_limbs == b->capacity) {
+        b->capacity *= 2;
+        b->limbs = realloc(b->limbs, b->capacity * sizeof(uint64_t));
     }
+    b->limbs[b->num_limbs++] = limb;
+}
 
-    size_t total_paths = 0;
-    int64_t beam_x = tm->splitters[splitter_index].x;
-    bool left = beam_x > 0;
-    bool right = beam_x + 1 < (int64_t)tm->width;
-    bool found_left = false;
-    bool found_right = false;
-
-    for (size_t i = splitter_index + 1; i < tm->num_splitters; ++i) {
-        int64_t next_splitter_x = tm->splitters[i].x;
-        if (left && !found_left && next_splitter_x == beam_x - 1) {
-            total_paths += paths_count2(tm, i, memo);
-            found_left = true;
-        } else if (right && !found_right && next_splitter_x == beam_x + 1) {
-            total_paths += paths_count2(tm, i, memo);
-            found_right = true;
-        }
+struct bignum* new_bignum(unsigned __int128 value)
+{
+    struct bignum* b = malloc(sizeof(struct bignum));
+    b->capacity = 4;
+    b->num_limbs = 0;
+    b->limbs = malloc(b->capacity * sizeof(uint64_t));
+    bignum_push_limb(b, (uint64_t)value);
+    bignum_push_limb(b, (uint64_t)(value >> 64));
+    return b;
+}
 
-        if (found_left && found_right) {
-            break;
-        }
+void free_bignum(struct bignum* b)
+{
+    if (b) {
+        free(b->limbs);
+        free(b);
     }
+}
 
-    if (left && !found_left) {
-        total_paths += 1;
+// Adds `value` shifted left by `limb` limbs
+static void bignum_add_at(struct bignum* b, size_t limb, uint64_t value)
+{
+    while (value != 0) {
+        if (limb == b->num_limbs) {
+            bignum_push_limb(b, 0);
+        }
+        unsigned __int128 sum = (unsigned __int128)b->limbs[limb] + value;
+        b->limbs[limb++] = (uint64_t)sum;
+        value = (uint64_t)(sum >> 64);
     }
-    if (right && !found_right) {
-        total_paths += 1;
+}
+
+void bignum_add_u128(struct bignum* b, unsigned __int128 value)
+{
+    bignum_add_at(b, 0, (uint64_t)value);
+    bignum_add_at(b, 1, (uint64_t)(value >> 64));
+}
+
+void bignum_add(struct bignum* b, const struct bignum* other)
+{
+    for (size_t i = 0; i < other->num_limbs; ++i) {
+        bignum_add_at(b, i, other->limbs[i]);
     }
+}
 
-    memo[splitter_index] = malloc(sizeof(size_t));
-    *memo[splitter_index] = total_paths;
+// Decimal digits, most significant first. The caller frees the result.
+char* bignum_to_string(const struct bignum* b)
+{
+    // Peel off base 10^19 chunks, least significant first
+    const uint64_t chunk_base = 10000000000000000000ull;
+    uint64_t* limbs = malloc(b->num_limbs * sizeof(uint64_t));
+    memcpy(limbs, b->limbs, b->num_limbs * sizeof(uint64_t));
+    size_t num_limbs = b->num_limbs;
+    uint64_t* chunks = malloc((2 * num_limbs + 1) * sizeof(uint64_t));
+    size_t num_chunks = 0;
+    do {
+        uint64_t remainder = 0;
+        for (size_t i = num_limbs; i > 0; --i) {
+            unsigned __int128 cur = ((unsigned __int128)remainder << 64) | limbs[i - 1];
+            limbs[i - 1] = (uint64_t)(cur / chunk_base);
+            remainder = (uint64_t)(cur % chunk_base);
+        }
+        chunks[num_chunks++] = remainder;
+        while (num_limbs > 0 && limbs[num_limbs - 1] == 0) {
+            --num_limbs;
+        }
+    } while (num_limbs > 0);
 
-    return total_paths;
+    char* out = malloc(num_chunks * 19 + 1);
+    int len = sprintf(out, "%lu", chunks[num_chunks - 1]);
+    for (size_t i = num_chunks - 1; i > 0; --i) {
+        len += sprintf(out + len, "%019lu", chunks[i - 1]);
+    }
+    free(limbs);
+    free(chunks);
+    return out;
 }
 
-size_t paths_count(struct tachyon_manifold* tm, int64_t beam_x, size_t splitter_index_search)
+static void wide_int_promote(struct wide_int* w)
 {
-    bool found_splitter = false;
-    size_t total_paths = 0;
-    for (size_t i = splitter_index_search; i < tm->num_splitters; ++i) {
-        int64_t next_splitter_x = tm->splitters[i].x;
-        if (next_splitter_x == beam_x) {
-            if (beam_x > 0) {
-                total_paths += paths_count(tm, beam_x - 1, i + 1);
-            }
-            if (beam_x + 1 < (int64_t)tm->width) {
-                total_paths += paths_count(tm, beam_x + 1, i + 1);
-            }
-            found_splitter = true;
-            break;
+    if (!w->big) {
+        w->big = new_bignum(w->small);
+    }
+}
+
+void wide_int_add_u128(struct wide_int* w, unsigned __int128 value)
+{
+    if (!w->big) {
+        unsigned __int128 sum;
+        if (!__builtin_add_overflow(w->small, value, &sum)) {
+            w->small = sum;
+            return;
         }
+        wide_int_promote(w);
     }
+    bignum_add_u128(w->big, value);
+}
 
-    if (!found_splitter) {
-        return 1;
+void wide_int_add(struct wide_int* w, const struct wide_int* other)
+{
+    if (!other->big) {
+        wide_int_add_u128(w, other->small);
+        return;
     }
+    wide_int_promote(w);
+    bignum_add(w->big, other->big);
+}
 
-    return total_paths;
+void free_wide_int(struct wide_int* w)
+{
+    free_bignum(w->big);
+    w->big = NULL;
 }
 
-void part2(struct tachyon_manifold* tm)
+// The caller frees the result.
+char* wide_int_to_string(const struct wide_int* w)
 {
-    size_t** memo = calloc(tm->num_splitters, sizeof(size_t*));
+    if (w->big) {
+        return bignum_to_string(w->big);
+    }
+    char digits[40];
+    size_t len = 0;
+    unsigned __int128 value = w->small;
+    do {
+        digits[len++] = (char)('0' + (int)(value % 10));
+        value /= 10;
+    } while (value > 0);
+    char* out = malloc(len + 1);
+    for (size_t i = 0; i < len; ++i) {
+        out[i] = digits[len - 1 - i];
+    }
+    out[len] = '\0';
+    return out;
+}
 
-    int64_t start_x = tm->start.x;
-    size_t first_splitter_idx = SIZE_MAX;
-    for (size_t i = 0; i < tm->num_splitters; ++i) {
-        if (tm->splitters[i].x == start_x) {
-            first_splitter_idx = i;
-            break;
-        }
+// One splitter row of the part 2 sweep while every count fits in 128 bits. Counts and masks are padded by a column
+// on each side, so a split at the edge sends that half of its paths into a pad column and they drop out, as beams
+// leaving the manifold do. The loop is branch-free over the whole row. Returns false, leaving `counts` untouched,
+// if any column overflowed.
+static bool split_row(
+    const unsigned __int128* counts, unsigned __int128* next, const unsigned __int128* mask, size_t width)
+{
+    bool overflowed = false;
+    for (size_t x = 1; x <= width; ++x) {
+        unsigned __int128 kept = counts[x] & ~mask[x];
+        unsigned __int128 from_left = counts[x - 1] & mask[x - 1];
+        unsigned __int128 from_right = counts[x + 1] & mask[x + 1];
+        unsigned __int128 sum;
+        overflowed |= __builtin_add_overflow(kept, from_left, &sum);
+        overflowed |= __builtin_add_overflow(sum, from_right, &next[x]);
     }
+    return !overflowed;
+}
 
-    if (first_splitter_idx == SIZE_MAX) {
-        fprintf(stderr, "Start position does not align with any splitter for part 2\n");
-        exit(EXIT_FAILURE);
+// The same row once some column has overflowed: big[x], when set, holds column x's count instead of counts[x].
+// Only the columns that overflow are promoted.
+static void split_row_wide(unsigned __int128* counts, struct bignum** big, unsigned __int128* next,
+    struct bignum** next_big, const unsigned __int128* mask, size_t width)
+{
+    for (size_t x = 1; x <= width; ++x) {
+        struct wide_int sum = { 0 };
+        for (size_t from = x - 1; from <= x + 1; ++from) {
+            bool moves = mask[from] != 0;
+            if ((from == x) != moves) {
+                struct wide_int count = { .small = counts[from], .big = big[from] };
+                wide_int_add(&sum, &count);
+            }
+        }
+        next[x] = sum.small;
+        next_big[x] = sum.big;
     }
+    for (size_t x = 1; x <= width; ++x) {
+        free_bignum(big[x]);
+        big[x] = next_big[x];
+        counts[x] = next[x];
+    }
+}
 
-    size_t total_paths = paths_count2(tm, first_splitter_idx, memo);
+// Sweeps the manifold top to bottom with counts[x + 1] holding the number of paths that reach column x. Splitters
+// are stored in row-major order, so each splitter row is a contiguous run of them. The caller frees the result with
+// free_wide_int.
+struct wide_int count_paths(const struct tachyon_manifold* tm)
+{
+    size_t width = tm->width;
+    unsigned __int128* counts = calloc(width + 2, sizeof(unsigned __int128));
+    unsigned __int128* next = calloc(width + 2, sizeof(unsigned __int128));
+    unsigned __int128* mask = calloc(width + 2, sizeof(unsigned __int128));
+    struct bignum** big = NULL;
+    struct bignum** next_big = NULL;
+    counts[tm->start.x + 1] = 1;
+
+    size_t i = 0;
+    while (i < tm->num_splitters) {
+        int64_t y = tm->splitters[i].y;
+        size_t row_end = i;
+        while (row_end < tm->num_splitters && tm->splitters[row_end].y == y) {
+            ++row_end;
+        }
+        if (y > tm->start.y) {
+            for (size_t j = i; j < row_end; ++j) {
+                mask[tm->splitters[j].x + 1] = ~(unsigned __int128)0;
+            }
+            if (!big && split_row(counts, next, mask, width)) {
+                unsigned __int128* swap = counts;
+                counts = next;
+                next = swap;
+            } else {
+                if (!big) {
+                    big = calloc(width + 2, sizeof(struct bignum*));
+                    next_big = calloc(width + 2, sizeof(struct bignum*));
+                }
+                split_row_wide(counts, big, next, next_big, mask, width);
+            }
+            for (size_t j = i; j < row_end; ++j) {
+                mask[tm->splitters[j].x + 1] = 0;
+            }
+        }
+        i = row_end;
+    }
 
-    for (size_t i = 0; i < tm->num_splitters; ++i) {
-        if (memo[i]) {
-            free(memo[i]);
+    struct wide_int total_paths = { 0 };
+    for (size_t x = 1; x <= width; ++x) {
+        struct wide_int count = { .small = counts[x], .big = big ? big[x] : NULL };
+        wide_int_add(&total_paths, &count);
+        if (big) {
+            free_bignum(big[x]);
         }
     }
-    free(memo);
+    free(counts);
+    free(next);
+    free(mask);
+    free(big);
+    free(next_big);
+    return total_paths;
+}
 
-    printf("Part 2: Total distinct paths through the manifold: %zu\n", total_paths);
+void part2(struct tachyon_manifold* tm)
+{
+    struct wide_int total_paths = count_paths(tm);
+    char* digits = wide_int_to_string(&total_paths);
+    printf("Part 2: Total distinct paths through the manifold: %s\n", digits);
+    free(digits);
+    free_wide_int(&total_paths);
 }
 
 void parse_and_run(FILE* input_stream)